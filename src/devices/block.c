@@ -139,6 +139,52 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
   block->write_cnt++;
 }
 
+/* Reads the CNT consecutive sectors starting at SECTOR from
+   BLOCK.  Sector SECTOR + i is read into BUFFERS[i], which must
+   have room for BLOCK_SECTOR_SIZE bytes.  Drivers that support it
+   get the whole run as a single request. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffers[], size_t cnt)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (block->ops->read_multiple != NULL)
+    block->ops->read_multiple (block->aux, sector, buffers, cnt);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i, buffers[i]);
+  block->read_cnt += cnt;
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK.
+   BUFFERS[i], which must contain BLOCK_SECTOR_SIZE bytes, is
+   written to sector SECTOR + i.  Drivers that support it get the
+   whole run as a single request.  Returns after the block device
+   has acknowledged receiving all the data. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffers[], size_t cnt)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (block->ops->write_multiple != NULL)
+    block->ops->write_multiple (block->aux, sector, buffers, cnt);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i, buffers[i]);
+  block->write_cnt += cnt;
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
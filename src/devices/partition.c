@@ -317,8 +317,30 @@ partition_write (void *p_, block_sector_t sector, const void *buffer)
   block_write (p->block, p->start + sector, buffer);
 }
 
+/* Write CNT sectors starting at SECTOR to partition P from
+   BUFFERS, as a single request to the underlying block. */
+static void
+partition_write_multiple (void *p_, block_sector_t sector,
+                          const void *buffers[], size_t cnt)
+{
+  struct partition *p = p_;
+  block_write_multiple (p->block, p->start + sector, buffers, cnt);
+}
+
+/* Read CNT sectors starting at SECTOR from partition P into
+   BUFFERS, as a single request to the underlying block. */
+static void
+partition_read_multiple (void *p_, block_sector_t sector,
+                         void *buffers[], size_t cnt)
+{
+  struct partition *p = p_;
+  block_read_multiple (p->block, p->start + sector, buffers, cnt);
+}
+
 static struct block_operations partition_operations =
   {
     partition_read,
-    partition_write
+    partition_write,
+    partition_write_multiple,
+    partition_read_multiple
   };
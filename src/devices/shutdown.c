@@ -9,6 +9,7 @@
 #include "userprog/exception.h"
 #include "devices/block.h"
 #include "filesys/filesys.h"
+#include "filesys/cache.h"
 
 /* Keyboard control register port. */
 #define CONTROL_REG 0x64
@@ -115,6 +116,7 @@ print_stats (void)
   timer_print_stats ();
   thread_print_stats ();
   block_print_stats ();
+  cache_print_stats ();
   console_print_stats ();
   kbd_print_stats ();
   exception_print_stats ();
@@ -1,41 +1,153 @@
 #include "filesys/cache.h"
+#include <hash.h>
+#include <stdlib.h>
 #include "devices/timer.h"
+#include "lib/user/syscall.h"
+#include "threads/palloc.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
 
+/* default number of cached sectors, unless set by -cache=COUNT */
 #define BUFFER_CACHE_SIZE 64
-#define WRITE_BEHIND_INTERVAL 30
+/* most sectors -cache=COUNT may ask for, 32 MB of data */
+#define BUFFER_CACHE_MAX (64 * 1024)
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+/* how often the write-behind thread wakes up to check the dirty ratio */
+#define WRITE_BEHIND_TICKS (TIMER_FREQ / 10)
+/* seconds between sweeps for expired dirty blocks */
+#define WRITE_BEHIND_INTERVAL 1
+/* age in ticks after which a dirty block is written back */
+#define DIRTY_EXPIRE (5 * TIMER_FREQ)
+/* percentage of dirty entries that triggers an early write-back */
+#define DIRTY_HIGH_PCT 50
+/* most sectors cache_flush sends in one device request */
+#define FLUSH_BATCH_MAX 64
+/* capacity of the read-ahead queue */
+#define READ_AHEAD_Q_SIZE 64
+/* most consecutive sectors prefetched with one device request */
+#define READ_AHEAD_BATCH 8
+/* 2Q: share of the cache for blocks referenced once, and number of
+ * recently evicted such blocks remembered, in percent of the cache size */
+#define A1_IN_PCT 25
+#define A1_OUT_PCT 50
+/* most shards the cache is split into, and fewest entries in a shard */
+#define CACHE_SHARDS 16
+#define CACHE_SHARD_MIN 16
+
+struct cache_entry;
+struct cache_shard;
+
+/* 2Q queue an entry is on */
+enum cache_queue
+{
+  Q_NONE,                          /* on no queue, being replaced */
+  Q_A1,                            /* referenced once, FIFO */
+  Q_AM                             /* re-referenced, LRU */
+};
+
+/* Key of the sector index: maps a sector to the entry holding it */
+struct cache_tag
+{
+  block_sector_t sector;           /* sector this tag stands for */
+  struct cache_entry *entry;       /* entry holding (or about to hold) it */
+  struct hash_elem elem;           /* element in cache_index */
+};
 
 /* struct for cache entry */
 struct cache_entry
 {
   block_sector_t sector_id;        /* sector id */
   block_sector_t next_id;          /* id of sector to be loaded if flushing */
+  struct cache_tag tag;            /* indexes sector_id */
+  struct cache_tag next_tag;       /* indexes next_id during eviction */
   bool accessed;                   /* whether the entry is recently accessed */
   bool dirty;                      /* whether this cache is dirty */
+  int64_t dirty_since;             /* ticks when the entry became dirty */
   bool loading;                    /* whether this cache is being loaded */
   bool flushing;                   /* whether this cache is being flushed */
+  bool prefetched;                 /* loaded by read-ahead, not used yet */
   uint32_t AW;                     /* # of processes actively writing */
   uint32_t AR;                     /* # of processes actively reading */
   uint32_t WW;                     /* # of processes waiting to write */
   uint32_t WR;                     /* # of processes waiting to read */
   struct condition cache_ready;    /* whether this cache can be read/written */
   struct lock lock;                /* fine grained lock for a single cache */
-  uint8_t data[BLOCK_SECTOR_SIZE]; /* data for this sector */
+  uint8_t *data;                   /* data for this sector */
+  struct cache_shard *shard;       /* shard owning this entry */
+  enum cache_queue queue;          /* 2Q queue, under the shard lock */
+  struct list_elem q_elem;         /* element in a1_list or am_list */
 };
 
 typedef struct cache_entry cache_entry_t;
 
-/* cache array */
-static cache_entry_t buffer_cache[BUFFER_CACHE_SIZE];
+/* 2Q: a sector recently evicted from A1, remembered so that a reference
+ * to it soon after counts as a re-reference */
+struct cache_ghost
+{
+  block_sector_t sector;           /* the evicted sector */
+  struct hash_elem elem;           /* element in ghost_index */
+};
+
+/* A dirty sector picked up by cache_flush */
+struct flush_slot
+{
+  block_sector_t sector;           /* sector the entry held when picked */
+  cache_entry_t *entry;            /* the entry */
+};
+
+/* A slice of the cache. Sector S is only ever cached in shard
+ * S % shard_cnt, by one of the shard's entries, so each shard is looked up
+ * and replaced independently under its own lock. */
+struct cache_shard
+{
+  struct lock lock;                /* protects everything below */
+  struct hash index;               /* sector -> entry index */
+  cache_entry_t *entries;          /* first entry of the shard */
+  size_t size;                     /* number of entries */
+  size_t hand;                     /* clock hand, an index into entries */
+  struct list a1_list, am_list;    /* 2Q queues */
+  size_t a1_cnt;                   /* number of entries on a1_list */
+  struct cache_ghost *ghosts;      /* 2Q ring of remembered sectors */
+  size_t ghost_head;               /* oldest slot of the ring */
+  size_t ghost_cnt, ghost_max;     /* size and capacity of the ring */
+  struct hash ghost_index;         /* sector -> ghost index */
+  struct condition entry_free;     /* an entry may have become evictable */
+  size_t evict_waiters;            /* misses looking for a victim */
+};
+
+/* cache array, carved from palloc pages by cache_init */
+static cache_entry_t *buffer_cache;
+
+/* number of entries in buffer_cache */
+static size_t cache_size = BUFFER_CACHE_SIZE;
+
+/* replacement policy, set by -cache-policy */
+static enum cache_policy policy = CACHE_CLOCK;
+
+/* the shards, and their number */
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t shard_cnt;
+
+/* scratch array for cache_flush, one slot per entry */
+static struct flush_slot *flush_slots;
 
-/* clock hand for clock algorithm */
-static uint32_t hand;
+/* serializes cache_flush, which owns flush_slots */
+static struct lock flush_lock;
 
-/* global buffer cache */
-static struct lock global_cache_lock;
+/* counters, updated without locking like the block device counters */
+static struct cache_stats stats;
 
-/* read-ahead queue */
-static struct list read_ahead_q;
+/* number of dirty entries */
+static size_t dirty_cnt;
+
+/* protects dirty_cnt; acquired with an entry lock held, never the reverse */
+static struct lock dirty_lock;
+
+/* read-ahead queue: ring of sectors waiting to be prefetched */
+static block_sector_t read_ahead_q[READ_AHEAD_Q_SIZE];
+
+/* index of the oldest queued sector, and number of queued sectors */
+static size_t ra_q_head, ra_q_cnt;
 
 /* read-ahead queue lock */
 static struct lock ra_q_lock;
@@ -43,22 +155,205 @@ static struct lock ra_q_lock;
 /* read-ahead queue ready condition variable */
 static struct condition ra_q_ready;
 
-struct read_a
+static bool cache_contains (block_sector_t sector);
+static void cache_prefetch (block_sector_t sector, size_t cnt);
+
+static unsigned
+cache_tag_hash (const struct hash_elem *e, void *aux UNUSED)
 {
-  block_sector_t sector;
-  struct list_elem elem;
-};
-typedef struct read_a read_a_t;
+  return hash_int (hash_entry (e, struct cache_tag, elem)->sector);
+}
+
+static bool
+cache_tag_less (const struct hash_elem *a, const struct hash_elem *b,
+                void *aux UNUSED)
+{
+  return hash_entry (a, struct cache_tag, elem)->sector
+         < hash_entry (b, struct cache_tag, elem)->sector;
+}
+
+/* The shard SECTOR is cached in */
+static struct cache_shard *
+shard_of (block_sector_t sector)
+{
+  return &shards[sector % shard_cnt];
+}
+
+/* Find the entry indexed under SECTOR in SH, NULL if there is none.
+ * Must hold SH's lock. */
+static cache_entry_t *
+index_find (struct cache_shard *sh, block_sector_t sector)
+{
+  struct cache_tag key;
+  struct hash_elem *e;
+  key.sector = sector;
+  e = hash_find (&sh->index, &key.elem);
+  return e != NULL ? hash_entry (e, struct cache_tag, elem)->entry : NULL;
+}
+
+/* Index TAG under SECTOR in SH. Must hold SH's lock. */
+static void
+index_insert (struct cache_shard *sh, struct cache_tag *tag,
+              block_sector_t sector)
+{
+  struct hash_elem *old UNUSED;
+  tag->sector = sector;
+  if (sector == UINT32_MAX)
+    return;
+  old = hash_insert (&sh->index, &tag->elem);
+  ASSERT (old == NULL);
+}
+
+/* Drop TAG from SH's index, if it is there. Must hold SH's lock. */
+static void
+index_remove (struct cache_shard *sh, struct cache_tag *tag)
+{
+  if (tag->sector == UINT32_MAX)
+    return;
+  hash_delete (&sh->index, &tag->elem);
+  tag->sector = UINT32_MAX;
+}
+
+static unsigned
+cache_ghost_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct cache_ghost, elem)->sector);
+}
+
+static bool
+cache_ghost_less (const struct hash_elem *a, const struct hash_elem *b,
+                  void *aux UNUSED)
+{
+  return hash_entry (a, struct cache_ghost, elem)->sector
+         < hash_entry (b, struct cache_ghost, elem)->sector;
+}
+
+/* 2Q: remember SECTOR as evicted from A1 of SH, forgetting the oldest
+ * remembered sector if the ring is full */
+static void
+ghost_add (struct cache_shard *sh, block_sector_t sector)
+{
+  struct cache_ghost *g;
+  if (sh->ghost_max == 0 || sector == UINT32_MAX)
+    return;
+  if (sh->ghost_cnt == sh->ghost_max)
+  {
+    g = &sh->ghosts[sh->ghost_head];
+    if (g->sector != UINT32_MAX)
+      hash_delete (&sh->ghost_index, &g->elem);
+    sh->ghost_head = (sh->ghost_head + 1) % sh->ghost_max;
+    sh->ghost_cnt--;
+  }
+  g = &sh->ghosts[(sh->ghost_head + sh->ghost_cnt) % sh->ghost_max];
+  sh->ghost_cnt++;
+  g->sector = sector;
+  /* an older ghost of the same sector is left to age out of the ring */
+  if (hash_insert (&sh->ghost_index, &g->elem) != NULL)
+    g->sector = UINT32_MAX;
+}
+
+/* 2Q: forget SECTOR in SH if it is remembered, returning whether it was */
+static bool
+ghost_take (struct cache_shard *sh, block_sector_t sector)
+{
+  struct cache_ghost key;
+  struct hash_elem *e;
+  if (sh->ghost_max == 0)
+    return false;
+  key.sector = sector;
+  e = hash_delete (&sh->ghost_index, &key.elem);
+  if (e == NULL)
+    return false;
+  /* the slot stays in the ring until it ages out */
+  hash_entry (e, struct cache_ghost, elem)->sector = UINT32_MAX;
+  return true;
+}
+
+/* 2Q: entry C is referenced again. Blocks on A1 stay where they are, as
+ * repeated references right after a load (e.g. the sectors of a sequential
+ * read) are no sign of reuse; blocks on Am move to its most recent end.
+ * Called with the shard lock held. */
+static void
+queue_touch (cache_entry_t *c)
+{
+  if (policy == CACHE_2Q && c->queue == Q_AM)
+  {
+    list_remove (&c->q_elem);
+    list_push_back (&c->shard->am_list, &c->q_elem);
+  }
+}
+
+/* 2Q: entry C now holds SECTOR. It goes on Am if SECTOR was evicted from
+ * A1 recently, else on A1. Called with the shard lock held. */
+static void
+queue_insert (cache_entry_t *c, block_sector_t sector)
+{
+  struct cache_shard *sh = c->shard;
+  if (policy != CACHE_2Q)
+    return;
+  ASSERT (c->queue == Q_NONE);
+  if (ghost_take (sh, sector))
+  {
+    c->queue = Q_AM;
+    list_push_back (&sh->am_list, &c->q_elem);
+  }
+  else
+  {
+    c->queue = Q_A1;
+    list_push_back (&sh->a1_list, &c->q_elem);
+    sh->a1_cnt++;
+  }
+}
+
+/* 2Q: the oldest entry on LIST that may be evicted now, with its lock
+ * held, or NULL. Dirty entries are only taken if ALLOW_DIRTY. */
+static cache_entry_t *
+queue_pick (struct list *list, bool allow_dirty)
+{
+  struct list_elem *e;
+  for (e = list_begin (list); e != list_end (list); e = list_next (e))
+  {
+    cache_entry_t *c = list_entry (e, cache_entry_t, q_elem);
+    lock_acquire(&c->lock);
+    if (!c->flushing && !c->loading
+        && c->AW + c->AR + c->WW + c->WR == 0
+        && (allow_dirty || !c->dirty))
+      return c;
+    lock_release(&c->lock);
+  }
+  return NULL;
+}
 
 /* Prefetch interface */
 void
 cache_readahead(block_sector_t sector)
 {
+  cache_readahead_multiple(&sector, 1);
+}
+
+/* Queue the CNT sectors in SECTORS for prefetching, in order.
+ * Sectors already cached or queued are skipped; once the queue is full the
+ * rest are dropped, read-ahead being only a hint. */
+void
+cache_readahead_multiple(const block_sector_t *sectors, size_t cnt)
+{
+  size_t i, j;
   lock_acquire(&ra_q_lock);
-  read_a_t * r_ptr = (read_a_t *) malloc(sizeof(read_a_t));
-  r_ptr->sector = sector;
-  list_push_back(&read_ahead_q, &r_ptr->elem);
-  cond_signal(&ra_q_ready, &ra_q_lock);
+  for (i = 0; i < cnt && ra_q_cnt < READ_AHEAD_Q_SIZE; i++)
+  {
+    if (cache_contains(sectors[i]))
+      continue;
+    for (j = 0; j < ra_q_cnt; j++)
+      if (read_ahead_q[(ra_q_head + j) % READ_AHEAD_Q_SIZE] == sectors[i])
+        break;
+    if (j == ra_q_cnt)
+    {
+      read_ahead_q[(ra_q_head + ra_q_cnt) % READ_AHEAD_Q_SIZE] = sectors[i];
+      ra_q_cnt++;
+    }
+  }
+  if (ra_q_cnt > 0)
+    cond_signal(&ra_q_ready, &ra_q_lock);
   lock_release(&ra_q_lock);
 }
 
@@ -70,62 +365,319 @@ cache_readahead_daemon(void * aux UNUSED)
   while(true)
   {
     lock_acquire(&ra_q_lock);
-    while(list_empty(&read_ahead_q))
+    while(ra_q_cnt == 0)
     {
       cond_wait(&ra_q_ready, &ra_q_lock);
     }
-    struct list_elem * e_ptr = list_pop_front(&read_ahead_q);
-    read_a_t * ra_ptr = list_entry(e_ptr, read_a_t, elem);
-    block_sector_t sector = ra_ptr->sector;
-    free(ra_ptr);
+    /* take the longest run of consecutive sectors at the head */
+    block_sector_t sector = read_ahead_q[ra_q_head];
+    size_t cnt = 0;
+    do
+    {
+      ra_q_head = (ra_q_head + 1) % READ_AHEAD_Q_SIZE;
+      ra_q_cnt--;
+      cnt++;
+    }
+    while (ra_q_cnt > 0 && cnt < READ_AHEAD_BATCH
+           && read_ahead_q[ra_q_head] == sector + cnt);
     lock_release(&ra_q_lock);
-    void * tmp_buffer = (void *) malloc(BLOCK_SECTOR_SIZE);
-    cache_read(sector, tmp_buffer);
-    free(tmp_buffer);
+    cache_prefetch(sector, cnt);
   }
 }
 
-/* Write every dirty cache block back to disk */
-void
-cache_flush(void)
+/* Mark entry C, whose lock is held, dirty. */
+static void
+cache_set_dirty (cache_entry_t *c)
+{
+  if (c->dirty)
+    return;
+  c->dirty = true;
+  c->dirty_since = timer_ticks ();
+  lock_acquire(&dirty_lock);
+  dirty_cnt++;
+  lock_release(&dirty_lock);
+}
+
+/* Mark entry C, whose lock is held, clean. */
+static void
+cache_clear_dirty (cache_entry_t *c)
+{
+  if (!c->dirty)
+    return;
+  c->dirty = false;
+  lock_acquire(&dirty_lock);
+  dirty_cnt--;
+  lock_release(&dirty_lock);
+}
+
+/* Whether dirty entries make up more than DIRTY_HIGH_PCT of the cache */
+static bool
+cache_dirty_high (void)
+{
+  bool high;
+  lock_acquire(&dirty_lock);
+  high = dirty_cnt * 100 > cache_size * DIRTY_HIGH_PCT;
+  lock_release(&dirty_lock);
+  return high;
+}
+
+/* Wait on the cache_ready condition of entry C, whose lock is held */
+static void
+cache_wait (cache_entry_t *c)
+{
+  int64_t start = timer_ticks ();
+  cond_wait(&c->cache_ready, &c->lock);
+  stats.waits++;
+  stats.wait_ticks += timer_elapsed (start);
+}
+
+/* Wake up the misses of C's shard waiting for a victim, after C has been
+ * released by its user. Called without C's lock held. A miss counts
+ * itself in evict_waiters before it looks at any entry, so one that has
+ * seen C busy is counted by the time C is released. */
+static void
+cache_entry_released (cache_entry_t *c)
+{
+  struct cache_shard *sh = c->shard;
+  if (sh->evict_waiters == 0)
+    return;
+  lock_acquire(&sh->lock);
+  cond_broadcast(&sh->entry_free, &sh->lock);
+  lock_release(&sh->lock);
+}
+
+static int
+flush_slot_less (const void *a_, const void *b_)
+{
+  const struct flush_slot *a = a_;
+  const struct flush_slot *b = b_;
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Write the N entries of BATCH, which hold consecutive sectors starting at
+ * BATCH[0]->sector_id and are all marked flushing, with a single device
+ * request, then mark them clean. */
+static void
+cache_flush_batch (cache_entry_t **batch, size_t n)
+{
+  const void *buffers[FLUSH_BATCH_MAX];
+  size_t i;
+  if (n == 0)
+    return;
+  for (i = 0; i < n; i++)
+    buffers[i] = batch[i]->data;
+  block_write_multiple(fs_device, batch[0]->sector_id, buffers, n);
+  stats.flush_batches++;
+  stats.flush_sectors += n;
+  if (n > stats.flush_batch_max)
+    stats.flush_batch_max = n;
+  for (i = 0; i < n; i++)
+  {
+    lock_acquire(&batch[i]->lock);
+    batch[i]->flushing = false;
+    cache_clear_dirty(batch[i]);
+    cond_broadcast(&batch[i]->cache_ready, &batch[i]->lock);
+    lock_release(&batch[i]->lock);
+    cache_entry_released(batch[i]);
+  }
+}
+
+/* Write back every cache block that has been dirty since CUTOFF ticks or
+ * earlier. Dirty sectors are sorted and contiguous runs go out as one
+ * request each, so the disk sees an ascending sequence of large writes. */
+static void
+cache_flush_dirty (int64_t cutoff)
 {
-  uint32_t c_ind = 0;
-  for(c_ind = 0; c_ind < BUFFER_CACHE_SIZE; c_ind++ )
+  cache_entry_t *batch[FLUSH_BATCH_MAX];
+  size_t batch_cnt = 0;
+  size_t slot_cnt = 0;
+  size_t i;
+
+  lock_acquire(&flush_lock);
+  /* collect the dirty sectors */
+  for (i = 0; i < cache_size; i++)
   {
-    lock_acquire(&buffer_cache[c_ind].lock);
-    if(buffer_cache[c_ind].dirty)
+    cache_entry_t *c = &buffer_cache[i];
+    lock_acquire(&c->lock);
+    if (c->dirty && !c->flushing && !c->loading && c->dirty_since <= cutoff)
     {
-      /* if this cache is being flushed, skip this block
-       * since it will be "clean" after it is flushed */
-      if(buffer_cache[c_ind].flushing || buffer_cache[c_ind].loading)
-      {
-        lock_release(&buffer_cache[c_ind].lock);
-        continue;
-      }
-      buffer_cache[c_ind].flushing = true;
-      buffer_cache[c_ind].next_id = UINT32_MAX;
-      lock_release(&buffer_cache[c_ind].lock);
-      block_write(fs_device, buffer_cache[c_ind].sector_id,
-                  buffer_cache[c_ind].data);
-      lock_acquire(&buffer_cache[c_ind].lock);
-      buffer_cache[c_ind].flushing = false;
-      buffer_cache[c_ind].dirty = false;
-      cond_signal(&buffer_cache[c_ind].cache_ready,
-                  &buffer_cache[c_ind].lock);
-      lock_release(&buffer_cache[c_ind].lock);
+      flush_slots[slot_cnt].sector = c->sector_id;
+      flush_slots[slot_cnt].entry = c;
+      slot_cnt++;
+    }
+    lock_release(&c->lock);
+  }
+  qsort(flush_slots, slot_cnt, sizeof *flush_slots, flush_slot_less);
+
+  /* claim them in sector order, cutting a batch whenever the run breaks */
+  for (i = 0; i < slot_cnt; i++)
+  {
+    cache_entry_t *c = flush_slots[i].entry;
+    if (batch_cnt > 0
+        && (batch_cnt == FLUSH_BATCH_MAX
+            || batch[batch_cnt - 1]->sector_id + 1 != flush_slots[i].sector))
+    {
+      cache_flush_batch(batch, batch_cnt);
+      batch_cnt = 0;
     }
+    lock_acquire(&c->lock);
+    /* the entry may have been evicted or written back since it was picked;
+     * a block with an active writer is left for the next flush, since the
+     * writer would mark it dirty again anyway */
+    if (c->sector_id == flush_slots[i].sector && c->dirty && !c->flushing
+        && !c->loading && c->AW == 0)
+    {
+      c->flushing = true;
+      c->next_id = UINT32_MAX;
+      batch[batch_cnt++] = c;
+    }
+    lock_release(&c->lock);
   }
+  cache_flush_batch(batch, batch_cnt);
+  lock_release(&flush_lock);
+}
+
+/* Write every dirty cache block back to disk. */
+void
+cache_flush(void)
+{
+  cache_flush_dirty(INT64_MAX);
 }
 
-/* Write-behind function */
+/* Write-behind function. Blocks are written back once they have been dirty
+ * for DIRTY_EXPIRE ticks, or all at once when too much of the cache is
+ * dirty, so that eviction nearly always finds a clean victim. */
 static void
 write_behind_period (void * aux UNUSED)
 {
+  int64_t last_sweep = timer_ticks ();
   thread_current ()->cwd = dir_open_root ();
   while (true)
   {
-    timer_sleep (TIMER_FREQ * WRITE_BEHIND_INTERVAL);
-    cache_flush ();
+    timer_sleep (WRITE_BEHIND_TICKS);
+    if (cache_dirty_high ())
+    {
+      inode_flush_delayed (INT64_MAX);
+      free_map_flush ();
+      cache_flush ();
+      last_sweep = timer_ticks ();
+    }
+    else if (timer_elapsed (last_sweep) >= TIMER_FREQ * WRITE_BEHIND_INTERVAL)
+    {
+      /* delayed data is placed, and the free map keeps its changes in
+       * memory, until asked */
+      inode_flush_delayed (timer_ticks () - DIRTY_EXPIRE);
+      free_map_flush ();
+      cache_flush_dirty (timer_ticks () - DIRTY_EXPIRE);
+      last_sweep = timer_ticks ();
+    }
+  }
+}
+
+/* Set the number of sectors the cache holds, at most BUFFER_CACHE_MAX.
+ * SECTORS must be positive. Must be called before cache_init. */
+void
+cache_set_size (size_t sectors)
+{
+  ASSERT (sectors > 0);
+  cache_size = sectors < BUFFER_CACHE_MAX ? sectors : BUFFER_CACHE_MAX;
+}
+
+/* Set the replacement policy. Must be called before cache_init. */
+void
+cache_set_policy (enum cache_policy p)
+{
+  policy = p;
+}
+
+/* Allocate buffer_cache and its sector buffers from the kernel pool.
+ * If the pool runs dry, the cache is shrunk to what could be allocated. */
+static void
+cache_alloc (void)
+{
+  size_t entry_pages;
+  size_t i;
+
+  if (cache_size < SECTORS_PER_PAGE)
+    cache_size = SECTORS_PER_PAGE;
+  cache_size = ROUND_UP (cache_size, SECTORS_PER_PAGE);
+  for (;;)
+  {
+    entry_pages = DIV_ROUND_UP (cache_size * sizeof *buffer_cache, PGSIZE);
+    buffer_cache = palloc_get_multiple (PAL_ZERO, entry_pages, NULL);
+    flush_slots = malloc (cache_size * sizeof *flush_slots);
+    if (buffer_cache != NULL && flush_slots != NULL)
+      break;
+    if (buffer_cache != NULL)
+      palloc_free_multiple (buffer_cache, entry_pages);
+    free (flush_slots);
+    if (cache_size == SECTORS_PER_PAGE)
+      PANIC ("can't allocate %zu buffer cache entries", cache_size);
+    /* halve the cache, keeping it a whole number of pages */
+    printf ("buffer cache: out of memory for %zu entries\n", cache_size);
+    cache_size = ROUND_UP (cache_size / 2, SECTORS_PER_PAGE);
+  }
+
+  for (i = 0; i < cache_size; i += SECTORS_PER_PAGE)
+  {
+    uint8_t *page = palloc_get_multiple (PAL_ZERO, 1, NULL);
+    size_t j;
+    if (page == NULL)
+    {
+      if (i == 0)
+        PANIC ("can't allocate buffer cache");
+      printf ("buffer cache: out of memory, using %zu of %zu sectors\n",
+              i, cache_size);
+      cache_size = i;
+      break;
+    }
+    for (j = 0; j < SECTORS_PER_PAGE; j++)
+      buffer_cache[i + j].data = page + j * BLOCK_SECTOR_SIZE;
+  }
+}
+
+/* Split the cache into shards, as many as allowed while keeping at least
+ * CACHE_SHARD_MIN entries in each. The last shard takes the remainder. */
+static void
+cache_shard_init (void)
+{
+  size_t per_shard;
+  size_t i, j;
+
+  shard_cnt = cache_size / CACHE_SHARD_MIN;
+  if (shard_cnt > CACHE_SHARDS)
+    shard_cnt = CACHE_SHARDS;
+  if (shard_cnt == 0)
+    shard_cnt = 1;
+  per_shard = cache_size / shard_cnt;
+
+  for (i = 0; i < shard_cnt; i++)
+  {
+    struct cache_shard *sh = &shards[i];
+    lock_init (&sh->lock);
+    hash_init (&sh->index, cache_tag_hash, cache_tag_less, NULL);
+    sh->entries = buffer_cache + i * per_shard;
+    sh->size = i + 1 < shard_cnt ? per_shard : cache_size - i * per_shard;
+    for (j = 0; j < sh->size; j++)
+      sh->entries[j].shard = sh;
+    sh->hand = 0;
+    list_init (&sh->a1_list);
+    list_init (&sh->am_list);
+    sh->a1_cnt = 0;
+    sh->ghosts = NULL;
+    sh->ghost_head = 0;
+    sh->ghost_cnt = 0;
+    sh->ghost_max = 0;
+    hash_init (&sh->ghost_index, cache_ghost_hash, cache_ghost_less, NULL);
+    cond_init (&sh->entry_free);
+    sh->evict_waiters = 0;
+    if (policy == CACHE_2Q)
+    {
+      sh->ghost_max = sh->size * A1_OUT_PCT / 100;
+      sh->ghosts = malloc (sh->ghost_max * sizeof *sh->ghosts);
+      if (sh->ghosts == NULL)
+        sh->ghost_max = 0;
+    }
   }
 }
 
@@ -133,161 +685,252 @@ write_behind_period (void * aux UNUSED)
 void
 cache_init (void)
 {
-  hand = 0;
   uint32_t i = 0;
-  for (i = 0; i < BUFFER_CACHE_SIZE; i++)
+  cache_alloc ();
+  cache_shard_init ();
+  for (i = 0; i < cache_size; i++)
   {
     buffer_cache[i].sector_id = UINT32_MAX;
     buffer_cache[i].next_id = UINT32_MAX;
+    buffer_cache[i].tag.sector = UINT32_MAX;
+    buffer_cache[i].tag.entry = &buffer_cache[i];
+    buffer_cache[i].next_tag.sector = UINT32_MAX;
+    buffer_cache[i].next_tag.entry = &buffer_cache[i];
     buffer_cache[i].accessed = false;
     buffer_cache[i].dirty = false;
+    buffer_cache[i].dirty_since = 0;
     buffer_cache[i].loading = false;
     buffer_cache[i].flushing = false;
+    buffer_cache[i].prefetched = false;
     buffer_cache[i].AW = 0;
     buffer_cache[i].AR = 0;
     buffer_cache[i].WW = 0;
     buffer_cache[i].WR = 0;
     cond_init(&buffer_cache[i].cache_ready);
     lock_init(&buffer_cache[i].lock);
-    memset(buffer_cache[i].data, 0, BLOCK_SECTOR_SIZE*sizeof(uint8_t));
+    buffer_cache[i].queue = Q_NONE;
+    queue_insert(&buffer_cache[i], UINT32_MAX);
   }
-  lock_init(&global_cache_lock);
-  list_init(&read_ahead_q);
+  lock_init(&flush_lock);
+  dirty_cnt = 0;
+  lock_init(&dirty_lock);
+  ra_q_head = 0;
+  ra_q_cnt = 0;
   lock_init(&ra_q_lock);
   cond_init(&ra_q_ready);
   thread_create ("write_behind", PRI_DEFAULT, write_behind_period, NULL);
   thread_create ("read_ahead", PRI_DEFAULT, cache_readahead_daemon, NULL);
 }
 
-/* See whether there is a hit for sector. If yes, return cache id.
- * Else, return -1. */
-static int
+/* Look SECTOR up in the index of its shard.
+ * Hit : return the entry with its lock held, counted as a waiting writer if
+ *       WRITE_FLAG else as a waiting reader; the shard lock is released.
+ * Miss: return NULL with the shard lock held, so that the caller can
+ *       pick a victim before anyone else brings SECTOR in. */
+static cache_entry_t *
 is_in_cache (block_sector_t sector, bool write_flag)
 {
-  uint32_t i = 0;
-  for (i = 0; i < BUFFER_CACHE_SIZE; i++)
+  struct cache_shard *sh = shard_of(sector);
+  while (true)
   {
-    lock_acquire(&buffer_cache[i].lock);
-    /* if this sector is currently in cache */
-    if(buffer_cache[i].sector_id == sector)
+    lock_acquire(&sh->lock);
+    cache_entry_t *c = index_find(sh, sector);
+    if (c == NULL)
+      return NULL;
+    queue_touch(c);
+    lock_acquire(&c->lock);
+    lock_release(&sh->lock);
+    /* the entry may be written back, either for SECTOR itself or for the
+     * sector it is being evicted for: wait until that is finished */
+    while (c->flushing)
     {
-      /* wait until this cache block is fully written to disk */
-      while(buffer_cache[i].flushing)
-      {
-        cond_wait(&buffer_cache[i].cache_ready, &buffer_cache[i].lock);
-      }
-      /* hit : the sector is still in cache after written to disk */
-      if(buffer_cache[i].sector_id == sector)
-      {
-        if(write_flag)
-          buffer_cache[i].WW++;
-        else
-          buffer_cache[i].WR++;
-        return i;
-      }
-      /* miss : the sector was being evicted, release lock */
-      else
-      {
-        lock_release(&buffer_cache[i].lock);
-        return -1;
-      }
+      cache_wait(c);
     }
-    /* if this sector is going to be loaded into cache */
-    else if(buffer_cache[i].flushing && buffer_cache[i].next_id == sector)
+    /* hit : the sector is in cache */
+    if (c->sector_id == sector)
     {
-      /* wait until this cache block is fully written to disk */
-      while(buffer_cache[i].flushing)
-      {
-        cond_wait(&buffer_cache[i].cache_ready, &buffer_cache[i].lock);
-      }
-      /* hit : the sector is in cache */
-      if(buffer_cache[i].sector_id == sector)
-      {
-        if(write_flag)
-          buffer_cache[i].WW++;
-        else
-          buffer_cache[i].WR++;
-        return i;
-      }
-      /* miss : the sector is no longer in cache */
+      if(write_flag)
+        c->WW++;
       else
-      {
-        lock_release(&buffer_cache[i].lock);
-        return -1;
-      }
+        c->WR++;
+      return c;
     }
-    /* not this cache entry, rlease lock, continue */
-    lock_release(&buffer_cache[i].lock);
+    /* the sector was evicted meanwhile and is on disk now, look again */
+    lock_release(&c->lock);
   }
-  return -1;
 }
 
-/* If the cache is full, find one cache to be evicted using clock algorithm
- * return the pointer of the cache to be evicted */
-/* When the cache isn't full, get the very first unused cache entry */
+/* is_in_cache for a read or write on behalf of a caller, as opposed to
+ * read-ahead, counting hits and misses */
+static cache_entry_t *
+cache_lookup (block_sector_t sector, bool write_flag)
+{
+  cache_entry_t *c = is_in_cache(sector, write_flag);
+  if (c == NULL)
+    stats.misses++;
+  else
+  {
+    stats.hits++;
+    if (c->prefetched)
+    {
+      stats.ra_hits++;
+      c->prefetched = false;
+    }
+  }
+  return c;
+}
+
+/* If the cache is full, find one cache of SH to be evicted using clock
+ * algorithm, return the id of the cache to be evicted, with its lock held */
+/* When the cache isn't full, get the very first unused cache entry.
+ * Returns UINT32_MAX if three sweeps find every entry in use. */
 static uint32_t
-cache_evict_id (void)
+cache_evict_clock (struct cache_shard *sh)
 {
-  while (1)
+  size_t scanned;
+  for (scanned = 0; scanned < 3 * sh->size; scanned++)
   {
-    lock_acquire(&buffer_cache[hand].lock);
+    cache_entry_t *c = &sh->entries[sh->hand];
+    sh->hand = (sh->hand + 1) % sh->size;
+    lock_acquire(&c->lock);
     /* if the cache block is being used, skip */
-    if (buffer_cache[hand].flushing || buffer_cache[hand].loading ||
-        buffer_cache[hand].AW + buffer_cache[hand].AR
-        + buffer_cache[hand].WW + buffer_cache[hand].WR > 0)
+    if (c->flushing || c->loading || c->AW + c->AR + c->WW + c->WR > 0)
     {
-      lock_release(&buffer_cache[hand].lock);
-      hand = (hand + 1) % BUFFER_CACHE_SIZE;
+      lock_release(&c->lock);
       continue;
     }
     /* if it has been accessed recently */
-    if (buffer_cache[hand].accessed)
+    if (c->accessed)
+    {
+      c->accessed = false;
+      lock_release(&c->lock);
+    }
+    /* prefer clean victims: a dirty block is left to the write-behind
+     * thread until two full sweeps have turned up nothing clean */
+    else if (c->dirty && scanned < 2 * sh->size)
     {
-      buffer_cache[hand].accessed = false;
-      lock_release(&buffer_cache[hand].lock);
-      hand = (hand + 1) % BUFFER_CACHE_SIZE;
+      lock_release(&c->lock);
     }
     /* if it hasn't been accessed recently, evict it */
     else
+      return c - buffer_cache;
+  }
+  return UINT32_MAX;
+}
+
+/* Find a cache to be evicted using 2Q and return its id, with its lock
+ * held and taken off its queue. Blocks referenced once are evicted first
+ * while A1 holds more than its share; blocks evicted from A1 are
+ * remembered in the ghost ring. Returns UINT32_MAX if every entry is in
+ * use. */
+static uint32_t
+cache_evict_2q (struct cache_shard *sh)
+{
+  bool a1_first = sh->a1_cnt * 100 > sh->size * A1_IN_PCT
+                  || list_empty (&sh->am_list);
+  struct list *first = a1_first ? &sh->a1_list : &sh->am_list;
+  struct list *second = a1_first ? &sh->am_list : &sh->a1_list;
+  size_t pass;
+  for (pass = 0; pass < 2; pass++)
+  {
+    /* as with the clock, take a dirty block only if nothing clean is free */
+    cache_entry_t *c = queue_pick (first, pass > 0);
+    if (c == NULL)
+      c = queue_pick (second, pass > 0);
+    if (c != NULL)
     {
-      uint32_t result = hand;
-      /* release global_cache_lock here, hold find-grained lock */
-      lock_release(&global_cache_lock);
-      hand = (hand + 1) % BUFFER_CACHE_SIZE;
-      return result;
+      list_remove (&c->q_elem);
+      if (c->queue == Q_A1)
+      {
+        sh->a1_cnt--;
+        ghost_add (sh, c->sector_id);
+      }
+      c->queue = Q_NONE;
+      return c - buffer_cache;
     }
   }
-  /* should never reach here */
-  ASSERT(1==0);
-  return 0;
+  return UINT32_MAX;
+}
+
+/* Find a cache of SH to be evicted with the configured policy, return its
+ * id with its lock held. Called with SH's lock held, after a miss on
+ * SECTOR. If every entry is in use and WAIT, SH's lock is released until
+ * one is let go, since the thread holding it may need SH's lock to do so.
+ * Returns UINT32_MAX if there is no victim without waiting, or if SECTOR
+ * was brought in by someone else in the meantime. */
+static uint32_t
+cache_evict_id (struct cache_shard *sh, block_sector_t sector, bool wait)
+{
+  uint32_t id;
+  sh->evict_waiters++;
+  while (true)
+  {
+    id = policy == CACHE_2Q ? cache_evict_2q (sh) : cache_evict_clock (sh);
+    if (id != UINT32_MAX || !wait)
+      break;
+    cond_wait(&sh->entry_free, &sh->lock);
+    if (index_find(sh, sector) != NULL)
+      break;
+  }
+  sh->evict_waiters--;
+  return id;
 }
 
-/* Return a cache block for cache_read_miss or cache_write_miss */
+/* Return a cache block for cache_read_miss or cache_write_miss.
+ * Called with the lock of SECTOR_ID's shard held, which is released here;
+ * the returned entry's lock is held. Returns NULL if there is no block
+ * for SECTOR_ID: either WAIT is false and every block of the shard is in
+ * use, or SECTOR_ID was brought in meanwhile and must be looked up
+ * again. */
 static cache_entry_t *
-cache_get_entry (block_sector_t sector_id)
+cache_get_entry (block_sector_t sector_id, bool wait)
 {
-  uint32_t evict_id = cache_evict_id();
+  struct cache_shard *sh = shard_of(sector_id);
+  uint32_t evict_id = cache_evict_id(sh, sector_id, wait);
+  if (evict_id == UINT32_MAX)
+  {
+    lock_release(&sh->lock);
+    return NULL;
+  }
+  cache_entry_t *c = &buffer_cache[evict_id];
+  if (c->sector_id != UINT32_MAX)
+  {
+    if (c->dirty)
+      stats.evict_dirty++;
+    else
+      stats.evict_clean++;
+    if (c->prefetched)
+      stats.ra_wasted++;
+  }
+  c->prefetched = false;
   /* if dirty, write back */
-  if (buffer_cache[evict_id].dirty)
+  if (c->dirty)
   {
-    buffer_cache[evict_id].flushing = true;
-    buffer_cache[evict_id].next_id = sector_id;
-    lock_release(&buffer_cache[evict_id].lock);
+    c->flushing = true;
+    c->next_id = sector_id;
+    /* lookups of SECTOR_ID now wait for this entry instead of missing */
+    index_insert(sh, &c->next_tag, sector_id);
+    lock_release(&sh->lock);
+    lock_release(&c->lock);
     /* IO */
-    block_write(fs_device, buffer_cache[evict_id].sector_id,
-                buffer_cache[evict_id].data);
-    lock_acquire(&buffer_cache[evict_id].lock);
+    block_write(fs_device, c->sector_id, c->data);
+    lock_acquire(&sh->lock);
+    lock_acquire(&c->lock);
+    index_remove(sh, &c->next_tag);
   }
   /* completely new cache block! */
-  buffer_cache[evict_id].dirty = false;
-  buffer_cache[evict_id].accessed = false;
-  buffer_cache[evict_id].sector_id = sector_id;
-  buffer_cache[evict_id].next_id = UINT32_MAX;
-  buffer_cache[evict_id].flushing = false;
-  /* flush complete, signal */
-  cond_signal(&buffer_cache[evict_id].cache_ready,
-              &buffer_cache[evict_id].lock);
-  return &buffer_cache[evict_id];
+  index_remove(sh, &c->tag);
+  index_insert(sh, &c->tag, sector_id);
+  queue_insert(c, sector_id);
+  lock_release(&sh->lock);
+  cache_clear_dirty(c);
+  c->accessed = false;
+  c->sector_id = sector_id;
+  c->next_id = UINT32_MAX;
+  c->flushing = false;
+  /* flush complete, wake up everyone waiting for either sector */
+  cond_broadcast(&c->cache_ready, &c->lock);
+  return c;
 }
 
 /* Reads sector SECTOR from cache into BUFFER. */
@@ -305,7 +948,7 @@ cache_read_routine (cache_entry_t * cur_c, void *buffer,
   /* multiple reader, single writer to the same block */
   while (cur_c->loading || cur_c->flushing || cur_c->WW + cur_c->AW > 0)
   {
-    cond_wait(&cur_c->cache_ready, &cur_c->lock);
+    cache_wait(cur_c);
   }
   cur_c->WR--;
   cur_c->AR++;
@@ -320,26 +963,21 @@ cache_read_routine (cache_entry_t * cur_c, void *buffer,
   /* set accessed to true */
   cur_c->accessed = true;
   lock_release(&cur_c->lock);
+  cache_entry_released(cur_c);
 }
 
-/* If there is a hit, copy from cache to buffer */
-static void
-cache_read_hit (void *buffer, off_t start, off_t length, uint32_t cache_id)
-{
-  cache_entry_t *cur_c;
-  cur_c = &buffer_cache[cache_id];
-  /* release global cache lock */
-  lock_release(&global_cache_lock);
-  cache_read_routine(cur_c, buffer, start, length);
-}
-
-/* If it is a miss, load this sector from disk to cache, then copy to buffer */
-static void
-cache_read_miss (block_sector_t sector, void *buffer, off_t start, off_t length)
+/* Load SECTOR from disk into a newly evicted cache block.
+ * Called with the shard lock held after a miss; returns the block with
+ * its lock held, or NULL if SECTOR must be looked up again (see
+ * cache_get_entry). */
+static cache_entry_t *
+cache_load (block_sector_t sector)
 {
   cache_entry_t *cur_c;
   /* get a cache block using eviction */
-  cur_c = cache_get_entry(sector);
+  cur_c = cache_get_entry(sector, true);
+  if (cur_c == NULL)
+    return NULL;
   /* currently loading cache from disk */
   cur_c->loading = true;
   lock_release(&cur_c->lock);
@@ -349,9 +987,96 @@ cache_read_miss (block_sector_t sector, void *buffer, off_t start, off_t length)
 
   lock_acquire(&cur_c->lock);
   cur_c->loading = false;
-  cond_signal(&cur_c->cache_ready, &cur_c->lock);
+  cond_broadcast(&cur_c->cache_ready, &cur_c->lock);
+  return cur_c;
+}
+
+/* If it is a miss, load this sector from disk to cache, then copy to buffer.
+ * Returns false if the sector must be looked up again. */
+static bool
+cache_read_miss (block_sector_t sector, void *buffer, off_t start, off_t length)
+{
+  cache_entry_t *cur_c = cache_load(sector);
+  if (cur_c == NULL)
+    return false;
   cur_c->WR++;
   cache_read_routine(cur_c, buffer, start, length);
+  return true;
+}
+
+/* Whether SECTOR is in cache or on its way in */
+static bool
+cache_contains (block_sector_t sector)
+{
+  bool found;
+  struct cache_shard *sh = shard_of(sector);
+  lock_acquire(&sh->lock);
+  found = index_find(sh, sector) != NULL;
+  lock_release(&sh->lock);
+  return found;
+}
+
+/* Read the N blocks of RUN, which have been claimed for consecutive sectors
+ * starting at RUN[0]->sector_id and are marked loading, with a single
+ * device request */
+static void
+cache_prefetch_run (cache_entry_t **run, size_t n)
+{
+  void *buffers[READ_AHEAD_BATCH];
+  size_t i;
+  if (n == 0)
+    return;
+  for (i = 0; i < n; i++)
+    buffers[i] = run[i]->data;
+  block_read_multiple(fs_device, run[0]->sector_id, buffers, n);
+  for (i = 0; i < n; i++)
+  {
+    lock_acquire(&run[i]->lock);
+    run[i]->loading = false;
+    run[i]->prefetched = true;
+    cond_broadcast(&run[i]->cache_ready, &run[i]->lock);
+    lock_release(&run[i]->lock);
+    cache_entry_released(run[i]);
+  }
+}
+
+/* Bring the CNT sectors starting at SECTOR into cache, without copying them
+ * anywhere. Each run of them that misses is read with one request. */
+static void
+cache_prefetch (block_sector_t sector, size_t cnt)
+{
+  cache_entry_t *run[READ_AHEAD_BATCH];
+  size_t run_cnt = 0;
+  size_t i;
+  ASSERT (cnt <= READ_AHEAD_BATCH);
+  for (i = 0; i < cnt; i++)
+  {
+    cache_entry_t *cur_c = is_in_cache(sector + i, false);
+    /* if miss, claim a block and read it along with the rest of the run;
+     * the shard lock is released by cache_get_entry. Read-ahead does not
+     * wait for a block while holding the run: the sector is skipped. */
+    if (cur_c == NULL)
+    {
+      cur_c = cache_get_entry(sector + i, false);
+      if (cur_c != NULL)
+      {
+        cur_c->loading = true;
+        lock_release(&cur_c->lock);
+        run[run_cnt++] = cur_c;
+        continue;
+      }
+    }
+    /* if hit, nothing to do but to undo is_in_cache's reservation */
+    else
+    {
+      cur_c->WR--;
+      lock_release(&cur_c->lock);
+      cache_entry_released(cur_c);
+    }
+    cache_prefetch_run(run, run_cnt);
+    run_cnt = 0;
+  }
+  cache_prefetch_run(run, run_cnt);
 }
 
 /* Reads bytes [start, start + length) in sector SECTOR from cache into
@@ -360,19 +1085,20 @@ void
 cache_read_partial (block_sector_t sector, void *buffer,
                     off_t start, off_t length)
 {
-  lock_acquire(&global_cache_lock);
-  int cache_id_hit = is_in_cache(sector, false);
-  /* if hit */
-  if(cache_id_hit != -1)
-  {
-    /* global_cache_lock released in cache_read_hit */
-    cache_read_hit(buffer, start, length, cache_id_hit);
-  }
-  /* if miss */
-  else
+  while (true)
   {
-    /* global_cache_lock released after finding a block to evict */
-    cache_read_miss(sector, buffer, start, length);
+    cache_entry_t *cur_c = cache_lookup(sector, false);
+    /* if hit */
+    if(cur_c != NULL)
+    {
+      /* the shard lock is already released by is_in_cache */
+      cache_read_routine(cur_c, buffer, start, length);
+      return;
+    }
+    /* if miss, the shard lock is released after indexing the evicted
+     * block; look again if the sector came in while waiting for one */
+    if (cache_read_miss(sector, buffer, start, length))
+      return;
   }
 }
 
@@ -384,7 +1110,7 @@ cache_write_routine (cache_entry_t * cur_c, const void *buffer,
   /* multiple reader, single writer to the same block */
   while(cur_c->loading || cur_c->flushing || cur_c->AR + cur_c->AW > 0)
   {
-    cond_wait(&cur_c->cache_ready, &cur_c->lock);
+    cache_wait(cur_c);
   }
   cur_c->WW--;
   cur_c->AW++;
@@ -399,33 +1125,29 @@ cache_write_routine (cache_entry_t * cur_c, const void *buffer,
   /* set accessed to true */
   cur_c->accessed = true;
   /* set dirty to true */
-  cur_c->dirty = true;
+  cache_set_dirty(cur_c);
   lock_release(&cur_c->lock);
-}
-
-/* If there is a hit, copy from buffer to cache */
-static void
-cache_write_hit (const void *buffer, off_t start,
-                         off_t length, uint32_t cache_id)
-{
-  cache_entry_t *cur_c;
-  cur_c = &buffer_cache[cache_id];
-  /* release global cache lock  */
-  lock_release(&global_cache_lock);
-  cache_write_routine(cur_c, buffer, start, length);
+  cache_entry_released(cur_c);
 }
 
 /* If it is a miss, load this sector from disk to cache, then copy buffer
- * to cache */
-static void
+ * to cache. Returns false if the sector must be looked up again. */
+static bool
 cache_write_miss (block_sector_t sector, const void *buffer,
                                   off_t start, off_t length)
 {
   cache_entry_t *cur_c;
-  /* get a cache block using eviction */
-  cur_c = cache_get_entry(sector);
+  /* get a cache block using eviction; unless the whole sector is about to
+   * be overwritten, the bytes around the written range come from disk */
+  if (start == 0 && length == BLOCK_SECTOR_SIZE)
+    cur_c = cache_get_entry(sector, true);
+  else
+    cur_c = cache_load(sector);
+  if (cur_c == NULL)
+    return false;
   cur_c->WW++;
   cache_write_routine(cur_c, buffer, start, length);
+  return true;
 }
 
 /* Writes BUFFER to the cache entry corresponding to the sector. */
@@ -441,18 +1163,125 @@ void
 cache_write_partial (block_sector_t sector, const void *buffer,
                                      off_t start, off_t length)
 {
-  lock_acquire(&global_cache_lock);
-  int cache_id_hit = is_in_cache (sector, true);
-  /* if hit */
-  if(cache_id_hit != -1)
+  while (true)
   {
-    /* global_cache_lock released in cache_write_hit */
-    cache_write_hit (buffer, start, length, cache_id_hit);
+    cache_entry_t *cur_c = cache_lookup (sector, true);
+    /* if hit */
+    if(cur_c != NULL)
+    {
+      /* the shard lock is already released by is_in_cache */
+      cache_write_routine (cur_c, buffer, start, length);
+      return;
+    }
+    /* if miss, the shard lock is released after indexing the evicted
+     * block; look again if the sector came in while waiting for one */
+    if (cache_write_miss (sector, buffer, start, length))
+      return;
+  }
+}
+
+/* Pin SECTOR in cache and return its block, loading it from disk on a miss.
+ * If EXCLUSIVE, the caller is the block's only user and may modify the data
+ * (see cache_mark_dirty), else it shares the block with other readers.
+ * The block stays in cache until released with cache_put. */
+struct cache_entry *
+cache_get (block_sector_t sector, bool exclusive)
+{
+  cache_entry_t *cur_c = cache_lookup(sector, exclusive);
+  /* if miss, the shard lock is released by cache_load; look again if the
+   * sector came in while waiting for a block */
+  while (cur_c == NULL)
+  {
+    cur_c = cache_load(sector);
+    if (cur_c == NULL)
+    {
+      cur_c = cache_lookup(sector, exclusive);
+      continue;
+    }
+    if (exclusive)
+      cur_c->WW++;
+    else
+      cur_c->WR++;
+  }
+  if (exclusive)
+  {
+    while (cur_c->loading || cur_c->flushing || cur_c->AR + cur_c->AW > 0)
+    {
+      cache_wait(cur_c);
+    }
+    cur_c->WW--;
+    cur_c->AW++;
   }
-  /* if miss */
   else
   {
-    /* global_cache_lock released after finding a block to evict */
-    cache_write_miss (sector, buffer, start, length);
+    while (cur_c->loading || cur_c->flushing || cur_c->WW + cur_c->AW > 0)
+    {
+      cache_wait(cur_c);
+    }
+    cur_c->WR--;
+    cur_c->AR++;
   }
+  cur_c->accessed = true;
+  lock_release(&cur_c->lock);
+  return cur_c;
+}
+
+/* Data of block CUR_C, pinned by cache_get */
+void *
+cache_data (struct cache_entry *cur_c)
+{
+  return cur_c->data;
+}
+
+/* Mark block CUR_C, pinned exclusively by cache_get, as modified */
+void
+cache_mark_dirty (struct cache_entry *cur_c)
+{
+  lock_acquire(&cur_c->lock);
+  ASSERT(cur_c->AW == 1);
+  cache_set_dirty(cur_c);
+  lock_release(&cur_c->lock);
+}
+
+/* Release block CUR_C, pinned by cache_get */
+void
+cache_put (struct cache_entry *cur_c)
+{
+  lock_acquire(&cur_c->lock);
+  /* an exclusive user excludes every other one */
+  if (cur_c->AW > 0)
+    cur_c->AW--;
+  else
+  {
+    ASSERT(cur_c->AR > 0);
+    cur_c->AR--;
+  }
+  cond_broadcast(&cur_c->cache_ready, &cur_c->lock);
+  lock_release(&cur_c->lock);
+  cache_entry_released(cur_c);
+}
+
+/* Copy the cache counters to STATS */
+void
+cache_get_stats (struct cache_stats *st)
+{
+  *st = stats;
+}
+
+/* Print cache statistics */
+void
+cache_print_stats (void)
+{
+  if (buffer_cache == NULL)
+    return;
+  printf ("Buffer cache: %zu sectors, %llu hits, %llu misses, "
+          "%llu read-ahead hits, %llu wasted prefetches\n",
+          cache_size, stats.hits, stats.misses, stats.ra_hits,
+          stats.ra_wasted);
+  printf ("Buffer cache: %llu clean evictions, %llu dirty evictions, "
+          "%llu waits for %llu ticks\n",
+          stats.evict_clean, stats.evict_dirty, stats.waits,
+          stats.wait_ticks);
+  printf ("Buffer cache: %llu write-backs of %llu sectors, largest %llu\n",
+          stats.flush_batches, stats.flush_sectors, stats.flush_batch_max);
 }
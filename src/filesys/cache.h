@@ -13,6 +13,19 @@
 #include "threads/malloc.h"
 #include "threads/synch.h"
 
+/* Set the number of cached sectors, before cache_init */
+void cache_set_size(size_t sectors);
+
+/* Replacement policies: clock over an accessed bit, or scan-resistant 2Q */
+enum cache_policy
+{
+  CACHE_CLOCK,
+  CACHE_2Q
+};
+
+/* Set the replacement policy, before cache_init */
+void cache_set_policy(enum cache_policy);
+
 /* Initialize cache */
 void cache_init(void);
 
@@ -32,10 +45,26 @@ void cache_read_partial(block_sector_t sector, void *buffer,
 void cache_write_partial(block_sector_t sector, const void *buffer,
                                 off_t start, off_t length);
 
+/* Pinned, zero-copy access to a cache block: cache_get pins the block
+ * holding SECTOR, shared for reading or exclusive for writing, and
+ * cache_data gives its BLOCK_SECTOR_SIZE bytes until cache_put releases
+ * it. A thread must not pin the same sector twice. */
+struct cache_entry;
+struct cache_entry *cache_get(block_sector_t sector, bool exclusive);
+void *cache_data(struct cache_entry *);
+void cache_mark_dirty(struct cache_entry *);
+void cache_put(struct cache_entry *);
+
 /* Prefetch interface */
 void cache_readahead(block_sector_t sector);
+void cache_readahead_multiple(const block_sector_t *sectors, size_t cnt);
 
 /* write every dirty cache block back to disk */
 void cache_flush(void);
 
+/* Counters */
+struct cache_stats;
+void cache_get_stats(struct cache_stats *);
+void cache_print_stats(void);
+
 #endif /* filesys/cache.h */
@@ -1,9 +1,12 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "lib/user/syscall.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
@@ -16,7 +19,8 @@ struct dir
     off_t pos;                          /* Current position. */
   };
 
-/* A single directory entry. */
+/* A single directory entry.  A free entry whose name is empty has
+   never been used; one that keeps a name held a removed file. */
 struct dir_entry 
   {
     block_sector_t inode_sector;        /* Sector number of header. */
@@ -25,16 +29,254 @@ struct dir_entry
     bool is_dir;                        /* Directory or file? */
   };
 
+/* A directory is a hash table of buckets, one per sector, each holding
+   BUCKET_ENTRIES entries.  Buckets come in pairs, 2k and 2k + 1, and a
+   name lives in the bucket its hash selects or, if that one is full,
+   in the other of its pair, so a lookup reads at most PROBE_MAX
+   sectors however large the directory.  A directory with a single
+   bucket may be shorter than a sector, and grows an entry at a time
+   until the bucket is full.
+
+   After that the table grows by linear hashing, a pair at a time:
+   whenever a name does not fit, the next pair in turn is split, its
+   entries rehashed between itself and a new pair at the end of the
+   file.  With LOW the largest power of two not above the number of
+   buckets, the first (buckets - LOW) buckets have been split in the
+   current round and are addressed by the hash modulo 2 * LOW, the
+   others modulo LOW.  A split touches four sectors, whatever the size
+   of the directory. */
+#define BUCKET_ENTRIES (BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+#define PROBE_MAX 2
+
+struct dir_bucket
+  {
+    struct dir_entry entries[BUCKET_ENTRIES];
+  };
+
+/* Name cache: remembers, for a directory's inumber and a name in it,
+   the inumber the name refers to, or that there is no such name.  It
+   is direct-mapped, so a new entry replaces whichever one hashed to the
+   same slot.  Entries are changed under the directory's dir_lock by
+   dir_add() and dir_remove(), so a hit is as current as the data. */
+#define DCACHE_SIZE 256
+
+/* Inumber of a name cache entry for a name that does not exist.
+   Sector 0 holds the free map, never a file or directory. */
+#define DCACHE_NEGATIVE 0
+
+struct dcache_entry
+  {
+    bool valid;                         /* In use? */
+    block_sector_t parent;              /* Directory's inumber. */
+    char name[NAME_MAX + 1];            /* Name within it. */
+    block_sector_t inumber;             /* Or DCACHE_NEGATIVE. */
+  };
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+static struct lock dcache_lock;
+
 static bool dir_empty (struct inode * inode);
 static bool lookup (const struct dir *dir, const char *name,
                     struct dir_entry *ep, off_t *ofsp);
 
+/* Initializes the directory module. */
+void
+dir_init (void)
+{
+  lock_init (&dcache_lock);
+}
+
+/* Returns the name cache slot for NAME in the directory at PARENT. */
+static struct dcache_entry *
+dcache_slot (block_sector_t parent, const char *name)
+{
+  return &dcache[(hash_string (name) ^ hash_int (parent)) % DCACHE_SIZE];
+}
+
+/* Looks NAME up in the directory at PARENT in the name cache.  On a hit
+   stores the inumber, or DCACHE_NEGATIVE, into *INUMBER and returns
+   true. */
+static bool
+dcache_get (block_sector_t parent, const char *name, block_sector_t *inumber)
+{
+  struct dcache_entry *d = dcache_slot (parent, name);
+  bool hit;
+  lock_acquire (&dcache_lock);
+  hit = d->valid && d->parent == parent && !strcmp (d->name, name);
+  if (hit)
+    *inumber = d->inumber;
+  lock_release (&dcache_lock);
+  return hit;
+}
+
+/* Records in the name cache that NAME in the directory at PARENT refers
+   to INUMBER, or to nothing if INUMBER is DCACHE_NEGATIVE. */
+static void
+dcache_put (block_sector_t parent, const char *name, block_sector_t inumber)
+{
+  struct dcache_entry *d = dcache_slot (parent, name);
+  if (strlen (name) > NAME_MAX)
+    return;
+  lock_acquire (&dcache_lock);
+  d->valid = true;
+  d->parent = parent;
+  strlcpy (d->name, name, sizeof d->name);
+  d->inumber = inumber;
+  lock_release (&dcache_lock);
+}
+
+/* Drops every name cache entry for names in the directory at PARENT,
+   which has been removed, so that a directory later created in the
+   same sector does not inherit them. */
+static void
+dcache_purge (block_sector_t parent)
+{
+  size_t i;
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    if (dcache[i].parent == parent)
+      dcache[i].valid = false;
+  lock_release (&dcache_lock);
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true);
+  size_t bucket_cnt = 2;
+  if (entry_cnt <= BUCKET_ENTRIES)
+    return inode_create (sector, entry_cnt * sizeof (struct dir_entry),
+                         true);
+  while (bucket_cnt * BUCKET_ENTRIES < entry_cnt)
+    bucket_cnt *= 2;
+  return inode_create (sector, bucket_cnt * BLOCK_SECTOR_SIZE, true);
+}
+
+/* Returns the number of buckets in directory INODE. */
+static size_t
+bucket_cnt (struct inode *inode)
+{
+  off_t length = inode_length (inode);
+  return length <= BLOCK_SECTOR_SIZE
+         ? 1 : DIV_ROUND_UP (length, BLOCK_SECTOR_SIZE);
+}
+
+/* Returns the largest power of two not above CNT, which is not 0. */
+static size_t
+round_low (size_t cnt)
+{
+  size_t low = 1;
+  while (low <= cnt / 2)
+    low *= 2;
+  return low;
+}
+
+/* Returns the bucket that NAME hashes to in a directory of CNT
+   buckets. */
+static size_t
+home_bucket (const char *name, size_t cnt)
+{
+  unsigned hash = hash_string (name);
+  size_t low = round_low (cnt);
+  size_t idx = hash % low;
+  if (idx < cnt - low)
+    idx = hash % (2 * low);
+  return idx;
+}
+
+/* Reads bucket IDX of directory INODE into BUCKET and returns the
+   number of entries it has. */
+static size_t
+read_bucket (struct inode *inode, size_t idx, struct dir_bucket *bucket)
+{
+  return inode_read_at (inode, bucket, sizeof *bucket,
+                        idx * BLOCK_SECTOR_SIZE) / sizeof (struct dir_entry);
+}
+
+/* Returns the byte offset of entry SLOT of bucket IDX. */
+static off_t
+entry_ofs (size_t idx, size_t slot)
+{
+  return idx * BLOCK_SECTOR_SIZE + slot * sizeof (struct dir_entry);
+}
+
+/* Returns the offset of the directory entry that follows the one at
+   OFS, skipping the unused tail of each bucket's sector. */
+static off_t
+next_entry_ofs (off_t ofs)
+{
+  ofs += sizeof (struct dir_entry);
+  if (ofs % BLOCK_SECTOR_SIZE + sizeof (struct dir_entry) > BLOCK_SECTOR_SIZE)
+    ofs = ROUND_UP (ofs, BLOCK_SECTOR_SIZE);
+  return ofs;
+}
+
+/* Splits the next pair of buckets of directory INODE, which has more
+   than one, or its lone bucket, rehashing the entries between it and
+   the new buckets at the end.  Entries of removed files are dropped.
+   The new buckets are written before the old ones are rewritten. */
+static bool
+dir_grow (struct inode *inode)
+{
+  size_t cnt = bucket_cnt (inode);
+  size_t first = cnt == 1 ? 0 : cnt - round_low (cnt);
+  size_t old_cnt = cnt == 1 ? 1 : PROBE_MAX;
+  size_t new_cnt = cnt == 1 ? 2 : cnt + PROBE_MAX;
+  /* Buckets FIRST and on, then CNT and on, as they will be */
+  struct dir_bucket *split = calloc (2 * PROBE_MAX, sizeof *split);
+  struct dir_bucket *bucket = malloc (sizeof *bucket);
+  bool success = false;
+  size_t i, slot, n;
+
+  if (split == NULL || bucket == NULL)
+    goto done;
+  for (i = 0; i < old_cnt; i++)
+    {
+      n = read_bucket (inode, first + i, bucket);
+      for (slot = 0; slot < n; slot++)
+        {
+          struct dir_entry *e = &bucket->entries[slot];
+          size_t home, probe, s;
+          bool placed = false;
+          if (!e->in_use)
+            continue;
+          /* A name of the pair goes back to it or to the new pair,
+             which between them have room for all of the pair's */
+          home = home_bucket (e->name, new_cnt);
+          for (probe = 0; !placed && probe < PROBE_MAX; probe++)
+            {
+              size_t idx = home ^ probe;
+              struct dir_bucket *b;
+              if (idx >= new_cnt)
+                break;
+              b = &split[idx < cnt ? idx - first : idx - cnt + PROBE_MAX];
+              for (s = 0; s < BUCKET_ENTRIES; s++)
+                if (!b->entries[s].in_use)
+                  {
+                    b->entries[s] = *e;
+                    placed = true;
+                    break;
+                  }
+            }
+          ASSERT (placed);
+        }
+    }
+
+  for (i = cnt; i < new_cnt; i++)
+    if (inode_write_at (inode, &split[i - cnt + PROBE_MAX], sizeof *bucket,
+                        i * BLOCK_SECTOR_SIZE) != sizeof *bucket)
+      goto done;
+  for (i = 0; i < old_cnt; i++)
+    if (inode_write_at (inode, &split[i], sizeof *bucket,
+                        (first + i) * BLOCK_SECTOR_SIZE) != sizeof *bucket)
+      goto done;
+  success = true;
+
+done:
+  free (split);
+  free (bucket);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -109,23 +351,63 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_bucket *bucket;
+  size_t cnt, home, probe, slot, n;
+  bool found = false;
   
   if (dir == NULL || name == NULL)
     return false;
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
-  return false;
+  bucket = malloc (sizeof *bucket);
+  if (bucket == NULL)
+    return false;
+  cnt = bucket_cnt (dir->inode);
+  home = home_bucket (name, cnt);
+  for (probe = 0; !found && probe < PROBE_MAX && (home ^ probe) < cnt;
+       probe++)
+    {
+      size_t idx = home ^ probe;
+      bool never_used = false;
+      n = read_bucket (dir->inode, idx, bucket);
+      for (slot = 0; slot < n; slot++)
+        {
+          struct dir_entry *e = &bucket->entries[slot];
+          if (e->in_use && !strcmp (name, e->name))
+            {
+              if (ep != NULL)
+                *ep = *e;
+              if (ofsp != NULL)
+                *ofsp = entry_ofs (idx, slot);
+              found = true;
+              break;
+            }
+          if (e->name[0] == '\0')
+            never_used = true;
+        }
+      /* Names only spill into the other bucket of a pair from a full
+         one */
+      if (never_used || n < BUCKET_ENTRIES)
+        break;
+    }
+  free (bucket);
+  return found;
+}
+
+/* Searches DIR, whose dir_lock is held, for NAME, first in the name
+   cache and then in the directory's data, whose answer is cached.
+   Returns the inumber NAME refers to, or DCACHE_NEGATIVE. */
+static block_sector_t
+find (const struct dir *dir, const char *name)
+{
+  block_sector_t parent = inode_get_inumber (dir->inode);
+  block_sector_t inumber;
+  struct dir_entry e;
+
+  if (dcache_get (parent, name, &inumber))
+    return inumber;
+  inumber = lookup (dir, name, &e, NULL) ? e.inode_sector : DCACHE_NEGATIVE;
+  dcache_put (parent, name, inumber);
+  return inumber;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -136,14 +418,15 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
-  struct dir_entry e;
+  block_sector_t inumber;
 
   if (dir == NULL || name == NULL)
     return false;
 
   dir_lock (dir->inode);
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  inumber = find (dir, name);
+  if (inumber != DCACHE_NEGATIVE)
+    *inode = inode_open (inumber);
   else
     *inode = NULL;
   dir_unlock (dir->inode);
@@ -162,6 +445,7 @@ dir_add (struct dir *dir, const char *name,
          block_sector_t inode_sector, bool is_dir)
 {
   struct dir_entry e;
+  struct dir_bucket *bucket = NULL;
   off_t ofs;
   bool success = false;
 
@@ -175,28 +459,55 @@ dir_add (struct dir *dir, const char *name,
   dir_lock (dir->inode);
 
   /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  if (find (dir, name) != DCACHE_NEGATIVE)
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
-
-  /* Write slot. */
   e.in_use = true;
   e.is_dir = is_dir;
+  memset (e.name, 0, sizeof e.name);
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
+
+  bucket = malloc (sizeof *bucket);
+  if (bucket == NULL)
+    goto done;
+
+  /* Set OFS to offset of a free slot in the buckets NAME may live in.
+     A lone bucket that is not full yet gets a new slot at the
+     end-of-file.  If there is no room, split a pair of buckets and
+     look again. */
+  for (;;)
+    {
+      size_t cnt = bucket_cnt (dir->inode);
+      size_t home = home_bucket (name, cnt);
+      size_t probe, slot, n = 0;
+      ofs = -1;
+      for (probe = 0; ofs < 0 && probe < PROBE_MAX && (home ^ probe) < cnt;
+           probe++)
+        {
+          size_t idx = home ^ probe;
+          n = read_bucket (dir->inode, idx, bucket);
+          for (slot = 0; slot < n; slot++)
+            if (!bucket->entries[slot].in_use)
+              {
+                ofs = entry_ofs (idx, slot);
+                break;
+              }
+        }
+      if (ofs < 0 && cnt == 1 && n < BUCKET_ENTRIES)
+        ofs = entry_ofs (0, n);
+      if (ofs >= 0)
+        break;
+      if (!dir_grow (dir->inode))
+        goto done;
+    }
+
+  /* Write slot. */
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (success)
+    dcache_put (inode_get_inumber (dir->inode), name, inode_sector);
 done:
+  free (bucket);
   dir_unlock (dir->inode);
   return success;
 }
@@ -250,6 +561,11 @@ dir_remove (struct dir *dir, const char *name)
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
 
+  /* Forget the name, and the names in a removed directory. */
+  dcache_put (inode_get_inumber (dir->inode), name, DCACHE_NEGATIVE);
+  if (e.is_dir)
+    dcache_purge (e.inode_sector);
+
   /* Remove inode. */
   inode_remove (inode); 
   success = true;
@@ -274,7 +590,7 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
   dir_lock (dir->inode);
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
   {
-    dir->pos += sizeof e;
+    dir->pos = next_entry_ofs (dir->pos);
     if (e.in_use && strcmp(e.name, ".") && strcmp(e.name, ".."))
     {
       strlcpy (name, e.name, NAME_MAX + 1);
@@ -287,16 +603,70 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
   return false;
 }
 
+/* Reads up to CNT of the next directory entries in DIR, with the
+   type and length of the file each names, into ENTRIES, a bucket at a
+   time.  Returns the number read, which is 0 once the directory
+   contains no more entries. */
+size_t
+dir_readdirs (struct dir *dir, struct readdir_entry *entries, size_t cnt)
+{
+  struct dir_bucket *bucket;
+  size_t read = 0;
+
+  if (dir == NULL || entries == NULL)
+    return 0;
+
+  bucket = malloc (sizeof *bucket);
+  if (bucket == NULL)
+    return 0;
+  dir_lock (dir->inode);
+  while (read < cnt)
+  {
+    size_t idx = dir->pos / BLOCK_SECTOR_SIZE;
+    size_t slot = dir->pos % BLOCK_SECTOR_SIZE / sizeof (struct dir_entry);
+    size_t entry_cnt = read_bucket (dir->inode, idx, bucket);
+
+    for (; slot < entry_cnt && read < cnt; slot++)
+    {
+      struct dir_entry *e = &bucket->entries[slot];
+      if (e->in_use && strcmp (e->name, ".") && strcmp (e->name, ".."))
+      {
+        struct readdir_entry *r = &entries[read++];
+        struct inode *inode = inode_open (e->inode_sector);
+        strlcpy (r->name, e->name, sizeof r->name);
+        r->is_dir = e->is_dir;
+        r->inumber = e->inode_sector;
+        r->size = inode != NULL ? inode_length (inode) : 0;
+        inode_close (inode);
+      }
+    }
+    if (slot < entry_cnt)
+      dir->pos = entry_ofs (idx, slot);
+    else if (entry_cnt == BUCKET_ENTRIES)
+      dir->pos = entry_ofs (idx + 1, 0);
+    else
+    {
+      /* Past the last entry: stay there, as dir_readdir() does. */
+      dir->pos = entry_ofs (idx, slot);
+      break;
+    }
+  }
+  dir_unlock (dir->inode);
+  free (bucket);
+
+  return read;
+}
+
 /* Check if an directory's inode is empty */
 static bool
 dir_empty (struct inode * inode)
 {
   ASSERT (inode_is_dir(inode));
   struct dir_entry e;
-  size_t ofs;
+  off_t ofs;
   for (ofs = 0;
       inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
-      ofs += sizeof e)
+      ofs = next_entry_ofs (ofs))
   {
     if (e.in_use && strcmp (".", e.name) && strcmp("..", e.name))
     {
@@ -13,8 +13,10 @@
 #define NAME_MAX 14
 
 struct inode;
+struct readdir_entry;
 
 /* Opening and closing directories. */
+void dir_init (void);
 bool dir_create (block_sector_t sector, size_t entry_cnt);
 struct dir *dir_open (struct inode *);
 struct dir *dir_open_root (void);
@@ -28,6 +30,7 @@ bool dir_lookup (const struct dir *, const char *name, struct inode **);
 bool dir_add (struct dir *, const char *name, block_sector_t, bool);
 bool dir_remove (struct dir *, const char *name);
 bool dir_readdir (struct dir *, char name[NAME_MAX + 1]);
+size_t dir_readdirs (struct dir *, struct readdir_entry *, size_t cnt);
 void dir_set_pos(struct dir *, off_t);
 off_t dir_get_pos(struct dir *);
 #endif /* filesys/directory.h */
@@ -7,6 +7,7 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    struct readahead ra;        /* Sequential read-ahead state. */
   };
 
 
@@ -69,7 +70,22 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = inode_read_at_ra (file->inode, buffer, size, file->pos,
+                                      &file->ra);
+  file->pos += bytes_read;
+  return bytes_read;
+}
+
+/* Reads from FILE into the CNT buffers of IOV in turn,
+   starting at the file's current position.
+   Returns the number of bytes actually read,
+   which may be less than their total if end of file is reached.
+   Advances FILE's position by the number of bytes read. */
+off_t
+file_readv (struct file *file, const struct iovec *iov, int cnt)
+{
+  off_t bytes_read = inode_readv_at (file->inode, iov, cnt, file->pos,
+                                     &file->ra);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -82,7 +98,7 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  return inode_read_at_ra (file->inode, buffer, size, file_ofs, &file->ra);
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
@@ -100,6 +116,19 @@ file_write (struct file *file, const void *buffer, off_t size)
   return bytes_written;
 }
 
+/* Writes the CNT buffers of IOV in turn into FILE,
+   starting at the file's current position.
+   Returns the number of bytes actually written,
+   which may be less than their total if an error occurs.
+   Advances FILE's position by the number of bytes written. */
+off_t
+file_writev (struct file *file, const struct iovec *iov, int cnt)
+{
+  off_t bytes_written = inode_writev_at (file->inode, iov, cnt, file->pos);
+  file->pos += bytes_written;
+  return bytes_written;
+}
+
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
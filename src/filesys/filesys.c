@@ -25,10 +25,13 @@ filesys_init (bool format)
     PANIC ("No file system device found, can't initialize file system.");
 
   inode_init ();
+  dir_init ();
   free_map_init ();
 
   if (format) 
     do_format ();
+  else
+    inode_adopt_layout (ROOT_DIR_SECTOR);
 
   free_map_open ();
 }
@@ -38,8 +41,10 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
-  cache_flush();
+  inode_flush_delayed_all ();
+  inode_reclaim_wait ();
   free_map_close ();
+  cache_flush();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -59,8 +64,11 @@ filesys_create (const char *name, off_t initial_size)
   if(!filesys_parse (name, &dir, &file_name))
     return false;
 
+  /* Place the inode near its directory's */
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_near (
+                       inode_get_inumber (dir_get_inode (dir)), 1,
+                       &inode_sector)
                   && inode_create (inode_sector, initial_size, false)
                   && dir_add (dir, file_name, inode_sector, false));
   if (!success && inode_sector != 0) 
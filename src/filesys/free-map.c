@@ -1,12 +1,45 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
+
+/* Free map bits stored in one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Sectors per allocation group.  Allocations start their search at
+   a goal sector, so that an inode lands near its directory and data
+   near its inode; groups decide where new directories go. */
+#define GROUP_SECTORS 512
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty_map;     /* Free map file sectors that differ
+                                        from free_map, one bit each. */
+static size_t free_cnt;              /* Clear bits in free_map. */
+static size_t reserved_cnt;          /* Free sectors promised to data
+                                        not yet placed on disk. */
+static struct lock free_map_lock;    /* Protects the above. */
+
+/* Serializes writing the free map file with closing it, and
+   guards flush_buf.  Taken before free_map_lock, never while
+   holding it, since writing the file may allocate. */
+static struct lock flush_lock;
+static uint8_t flush_buf[BLOCK_SECTOR_SIZE];   /* One sector of the map,
+                                                  as being written. */
+
+/* Notes that bits START through START + CNT (exclusive) of the
+   free map have changed. */
+static void
+mark_dirty (block_sector_t start, size_t cnt)
+{
+  size_t first = start / BITS_PER_SECTOR;
+  size_t last = (start + cnt - 1) / BITS_PER_SECTOR;
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
 
 /* Initializes the free map. */
 void
@@ -15,71 +48,321 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                           BLOCK_SECTOR_SIZE));
+  if (dirty_map == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
+  lock_init (&flush_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+}
+
+/* Takes the first run of CNT free sectors at or after GOAL, wrapping
+   around to the start of the disk if there is none, and returns its
+   first sector or BITMAP_ERROR.  Must be called with free_map_lock
+   held. */
+static size_t
+scan_near (block_sector_t goal, size_t cnt)
+{
+  size_t sector = BITMAP_ERROR;
+  if (goal < bitmap_size (free_map))
+    sector = bitmap_scan_and_flip (free_map, goal, cnt, false);
+  if (sector == BITMAP_ERROR && goal != 0)
+    sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  if (sector != BITMAP_ERROR)
+    {
+      mark_dirty (sector, cnt);
+      free_cnt -= cnt;
+    }
+  return sector;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available.  The change reaches the free map file
+   at the next free_map_flush(). */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (0, cnt, sectorp);
+}
+
+/* Like free_map_allocate(), but takes the first run of CNT free
+   sectors at or after GOAL, wrapping around to the start of the
+   disk if there is none.  Sectors reserved with free_map_reserve()
+   are left alone.  If no run is free, waits for the sectors of
+   removed files to be released and tries once more. */
+bool
+free_map_allocate_near (block_sector_t goal, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  size_t sector = BITMAP_ERROR;
+  bool waited = false;
+  for (;;)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      lock_acquire (&free_map_lock);
+      if (free_cnt - reserved_cnt >= cnt)
+        sector = scan_near (goal, cnt);
+      if (sector != BITMAP_ERROR)
+        *sectorp = sector;
+      lock_release (&free_map_lock);
+      if (sector != BITMAP_ERROR || waited)
+        break;
+      inode_reclaim_wait ();
+      waited = true;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
+/* Reserves CNT free sectors for data whose place on disk is chosen
+   later with free_map_claim().  Returns false if fewer than CNT
+   sectors are free and unreserved, even once the sectors of removed
+   files have been released. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+  bool waited = false;
+  for (;;)
+    {
+      lock_acquire (&free_map_lock);
+      success = free_cnt - reserved_cnt >= cnt;
+      if (success)
+        reserved_cnt += cnt;
+      lock_release (&free_map_lock);
+      if (success || waited)
+        break;
+      inode_reclaim_wait ();
+      waited = true;
+    }
+  return success;
+}
+
+/* Gives back CNT reserved sectors that will not be claimed. */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Allocates up to CNT of the reserved sectors as one run near GOAL,
+   taking a shorter run if no run of CNT is free, and stores its
+   first sector into *SECTORP.  Returns the length of the run. */
+size_t
+free_map_claim (block_sector_t goal, size_t cnt, block_sector_t *sectorp)
+{
+  size_t sector = BITMAP_ERROR;
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  for (; cnt > 0; cnt /= 2)
+    {
+      sector = scan_near (goal, cnt);
+      if (sector != BITMAP_ERROR)
+        break;
+    }
+  reserved_cnt -= cnt;
+  if (cnt > 0)
+    *sectorp = sector;
+  lock_release (&free_map_lock);
+  return cnt;
+}
+
+/* Allocates the CNT sectors starting at SECTOR, if they are all
+   free.  Returns true if successful, false if any of them is in
+   use or past the end of the device. */
+bool
+free_map_allocate_at (block_sector_t sector, size_t cnt)
+{
+  bool success = false;
+  lock_acquire (&free_map_lock);
+  if (sector + cnt <= bitmap_size (free_map)
+      && free_cnt - reserved_cnt >= cnt
+      && bitmap_none (free_map, sector, cnt))
+    {
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      mark_dirty (sector, cnt);
+      free_cnt -= cnt;
+      success = true;
+    }
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Returns the number of free sectors in allocation group GROUP.
+   Must be called with free_map_lock held. */
+static size_t
+group_free (size_t group)
+{
+  size_t size = bitmap_size (free_map);
+  size_t start = group * GROUP_SECTORS;
+  size_t len = size - start < GROUP_SECTORS ? size - start : GROUP_SECTORS;
+  return bitmap_count (free_map, start, len, false);
+}
+
+/* Returns the goal sector for a new directory whose parent's inode is
+   at PARENT: the start of the parent's group if that group has at
+   least its share of the free sectors, else of the group with the
+   most free sectors, so that directory trees spread over the disk
+   while each directory keeps its files close. */
+block_sector_t
+free_map_dir_goal (block_sector_t parent)
+{
+  size_t group_cnt, group, best, best_free = 0;
+
+  lock_acquire (&free_map_lock);
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  best = parent / GROUP_SECTORS;
+  if (best >= group_cnt || group_free (best) * group_cnt < free_cnt)
+    for (best = group = 0; group < group_cnt; group++)
+      {
+        size_t cnt = group_free (group);
+        if (cnt > best_free)
+          {
+            best = group;
+            best_free = cnt;
+          }
+      }
+  lock_release (&free_map_lock);
+  return best * GROUP_SECTORS;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
-  ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  struct free_run run;
+  run.start = sector;
+  run.cnt = cnt;
+  free_map_release_runs (&run, 1);
+}
+
+/* Makes the sectors of each of the N runs in RUNS available for
+   use, with a single update of the free map. */
+void
+free_map_release_runs (const struct free_run *runs, size_t n)
+{
+  size_t i;
+  lock_acquire (&free_map_lock);
+  for (i = 0; i < n; i++)
+    {
+      ASSERT (bitmap_all (free_map, runs[i].start, runs[i].cnt));
+      bitmap_set_multiple (free_map, runs[i].start, runs[i].cnt, false);
+      mark_dirty (runs[i].start, runs[i].cnt);
+      free_cnt += runs[i].cnt;
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Writes the sectors of the free map file that have changed
+   since they were last written.  Must be called with flush_lock
+   held.  Each sector is copied under free_map_lock and written
+   without it; a change made meanwhile marks it dirty again. */
+static void
+flush_locked (void)
+{
+  size_t idx = 0;
+
+  ASSERT (lock_held_by_current_thread (&flush_lock));
+  if (free_map_file == NULL)
+    return;
+  for (;;)
+    {
+      size_t size = 0;
+      off_t ofs = 0;
+
+      lock_acquire (&free_map_lock);
+      idx = bitmap_scan (dirty_map, idx, 1, true);
+      if (idx != BITMAP_ERROR)
+        {
+          bitmap_reset (dirty_map, idx);
+          ofs = idx * BLOCK_SECTOR_SIZE;
+          size = bitmap_copy_bytes (free_map, ofs, flush_buf,
+                                    BLOCK_SECTOR_SIZE);
+        }
+      lock_release (&free_map_lock);
+      if (idx == BITMAP_ERROR)
+        break;
+
+      if (file_write_at (free_map_file, flush_buf, size, ofs)
+          != (off_t) size)
+        {
+          lock_acquire (&free_map_lock);
+          bitmap_mark (dirty_map, idx);
+          lock_release (&free_map_lock);
+        }
+      idx++;
+    }
+}
+
+/* Writes the sectors of the free map file that have changed
+   since they were last written. */
+void
+free_map_flush (void)
+{
+  lock_acquire (&flush_lock);
+  flush_locked ();
+  lock_release (&flush_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
 void
 free_map_open (void) 
 {
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  struct file *file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
+  lock_acquire (&free_map_lock);
+  if (!bitmap_read (free_map, file))
     PANIC ("can't read free map");
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+  bitmap_set_all (dirty_map, false);
+  lock_release (&free_map_lock);
+
+  lock_acquire (&flush_lock);
+  free_map_file = file;
+  lock_release (&flush_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  lock_acquire (&flush_lock);
+  flush_locked ();
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&flush_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
-   it. */
+   it.  The file is created sparse, so the write allocates its
+   sectors; sectors of the map that were written before such an
+   allocation stay marked dirty for the next free_map_flush().  Every
+   sector of the file is backed afterward, so flushing never needs to
+   allocate, and the file is not used for flushing until then. */
 void
 free_map_create (void) 
 {
+  struct file *file;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
   /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  if (!bitmap_write (free_map, file))
     PANIC ("can't write free map");
+
+  lock_acquire (&flush_lock);
+  free_map_file = file;
+  lock_release (&flush_lock);
 }
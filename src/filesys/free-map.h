@@ -5,13 +5,29 @@
 #include <stddef.h>
 #include "devices/block.h"
 
+/* A run of CNT sectors starting at START. */
+struct free_run
+  {
+    block_sector_t start;
+    size_t cnt;
+  };
+
 void free_map_init (void);
 void free_map_read (void);
 void free_map_create (void);
 void free_map_open (void);
 void free_map_close (void);
+void free_map_flush (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (block_sector_t goal, size_t,
+                             block_sector_t *);
+block_sector_t free_map_dir_goal (block_sector_t parent);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
+size_t free_map_claim (block_sector_t goal, size_t, block_sector_t *);
+bool free_map_allocate_at (block_sector_t, size_t);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_runs (const struct free_run *, size_t);
 
 #endif /* filesys/free-map.h */
@@ -1,28 +1,89 @@
 #include "filesys/inode.h"
 #include <hash.h>
+#include <list.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/cache.h"
 #include "filesys/free-map.h"
+#include "devices/timer.h"
+#include "lib/user/syscall.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 
-/* Identifies an inode. */
+/* Identifies an inode, indexed, extent-mapped or with inline data. */
 #define INODE_MAGIC 0x494e4f44
+#define INODE_EXTENT_MAGIC 0x494e4f45
+#define INODE_INLINE_MAGIC 0x494e4f49
+/* Bytes of data an inline inode holds in its own sector */
+#define INLINE_CAPACITY 492
+/* Extents in an extent-mapped inode */
+#define EXTENT_CNT 61
+/* Most sectors an extent-mapped file preallocates when it grows */
+#define EXTENT_GROW_MAX 64
+/* Sectors an indexed file reserves at once while it is being extended */
+#define PREALLOC_SECTORS 16
 /* 128 indexes per sector */
 #define DIRECT_IDX_CNT 122
 #define IDX_PER_SECTOR (BLOCK_SECTOR_SIZE / 4)
 #define CAPACITY_L0    (DIRECT_IDX_CNT * BLOCK_SECTOR_SIZE)
 #define CAPACITY_L1    (IDX_PER_SECTOR * BLOCK_SECTOR_SIZE)
 #define CAPACITY_L2    (IDX_PER_SECTOR * IDX_PER_SECTOR * BLOCK_SECTOR_SIZE)
+/* Index entry of a sector that was never written, which reads as zeros.
+   Sector 0 holds the free map inode, so it is never file data. */
+#define SECTOR_HOLE 0
+/* Read-ahead window bounds, in sectors */
+#define RA_WINDOW_MIN  2
+#define RA_WINDOW_MAX  32
+/* Most unplaced sectors an inode holds under delayed allocation */
+#define DELAYED_MAX 64
+/* Runs of sectors released with one update of the free map */
+#define RELEASE_BATCH 32
 
 /* Hash of open inodes, so that opening a single inode twice
    returns the same 'struct inode'. */
 static struct hash open_inodes;
 static struct lock lock_open_inodes;
 
+/* True if new inodes map their data with extents. */
+static bool use_extents;
+
+/* True if writes to holes are kept in memory, and given sectors only
+   when they are flushed or the file is closed. */
+static bool delay_alloc;
+
+/* Open inodes holding unplaced data, oldest first. */
+static struct list delayed_inodes;
+static struct lock lock_delayed;
+
+/* A sector of file data written under delayed allocation, not yet
+   given a place on disk. One free sector is reserved for it, and
+   one for each index block its place will need. */
+struct delayed_block
+  {
+    struct list_elem elem;              /* Element in inode's list. */
+    off_t pos;                          /* File offset, sector aligned. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Contents. */
+  };
+
+/* Removed inodes whose sectors the reclaimer has yet to release. */
+static struct list reclaim_queue;
+static struct lock lock_reclaim;
+static struct condition reclaim_ready;  /* Signaled when queued. */
+static struct condition reclaim_idle;   /* Broadcast when drained. */
+static bool reclaim_busy;               /* Reclaimer is releasing one. */
+
+static void reclaim_daemon (void *aux);
+
+/* A run of LENGTH consecutive sectors starting at START. */
+struct extent
+  {
+    block_sector_t start;
+    block_sector_t length;
+  };
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
@@ -32,9 +93,31 @@ struct inode_disk
     unsigned magic;                        /* Magic number. */
     int is_dir;                            /* 1 if this inode is a dir,
                                               0 otherwise. */
-    block_sector_t idx0 [DIRECT_IDX_CNT];  /* Direct index. */
-    block_sector_t idx1;                   /* Single indirect index. */
-    block_sector_t idx2;                   /* Double indirect index. */
+    union
+      {
+        /* INODE_MAGIC: one index entry per sector. */
+        struct
+          {
+            block_sector_t idx0 [DIRECT_IDX_CNT];  /* Direct index. */
+            block_sector_t idx1;                   /* Single indirect. */
+            block_sector_t idx2;                   /* Double indirect. */
+          };
+        /* INODE_EXTENT_MAGIC: runs of sectors, which may extend past
+           the end of the file. */
+        struct
+          {
+            uint32_t extent_cnt;                   /* Extents in use. */
+            struct extent extents [EXTENT_CNT];    /* In file order. */
+          };
+        /* INODE_INLINE_MAGIC: the data itself, for files of up to
+           INLINE_CAPACITY bytes. */
+        struct
+          {
+            unsigned grow_magic;                   /* Layout to convert
+                                                      to when it grows. */
+            uint8_t inline_data [INLINE_CAPACITY]; /* File data. */
+          };
+      };
   };
 
 struct indirect_block
@@ -42,6 +125,23 @@ struct indirect_block
     block_sector_t idx [IDX_PER_SECTOR];
   };
 
+/* A removed inode queued for the reclaimer. */
+struct reclaim
+  {
+    struct list_elem elem;              /* Element in reclaim_queue. */
+    block_sector_t sector;              /* Inode sector. */
+    struct inode_disk data;             /* Copy of the on-disk inode. */
+  };
+
+/* A run of file sectors that are also consecutive on disk: file sectors
+   FIRST through FIRST + CNT - 1 live at SECTOR through SECTOR + CNT - 1 */
+struct sector_run
+  {
+    block_sector_t first;               /* First file sector. */
+    block_sector_t sector;              /* Its disk sector. */
+    block_sector_t cnt;                 /* Sectors in run, 0 if none. */
+  };
+
 /* In-memory inode. */
 struct inode 
   {
@@ -53,6 +153,20 @@ struct inode
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     off_t length;                       /* File size in bytes. */
     bool is_dir;                        /* True if inode is for directory */
+    block_sector_t prealloc_start;      /* Sectors reserved for appends, */
+    size_t prealloc_cnt;                /* under lock_inode. */
+    struct inode_disk data;             /* Copy of the on-disk inode,
+                                           changed under lock_inode. */
+    struct sector_run xlate;            /* Last translated run. */
+    struct list delayed;                /* Unplaced delayed_blocks in file
+                                           order, under lock_inode. */
+    size_t delayed_cnt;                 /* Blocks in delayed. */
+    size_t delayed_index_cnt;           /* Sectors reserved for the index
+                                           blocks they need. */
+    int64_t delayed_since;              /* When delayed became nonempty. */
+    struct list_elem delayed_elem;      /* In delayed_inodes while delayed
+                                           is nonempty. */
+    struct lock lock_xlate;             /* Guards xlate. */
     struct lock lock_inode;             /* Inode lock */
     struct lock lock_dir;               /* Dir lock */
   };
@@ -81,17 +195,51 @@ dir_unlock (struct inode *inode)
   lock_release (&inode->lock_dir);
 }
 
-/* Get sector number from indirect index block at SECTOR */
+/* Get sector number from indirect index block at SECTOR, which may be
+   a hole */
 static block_sector_t
 indirect_get_sector (block_sector_t sector, off_t ofs)
 {
-  struct indirect_block *indirect_block;
-  indirect_block = malloc (sizeof *indirect_block);
-  if (indirect_block == NULL)
-    return -1;
-  cache_read (sector, indirect_block);
+  if (sector == SECTOR_HOLE)
+    return SECTOR_HOLE;
+  struct cache_entry *ce = cache_get (sector, false);
+  struct indirect_block *indirect_block = cache_data (ce);
+  block_sector_t sec = indirect_block->idx[ofs];
+  cache_put (ce);
+  return sec;
+}
+
+/* Return the number of entries of IDX, starting at OFS and ending before
+   CNT, that hold consecutive sector numbers, or that are all holes */
+static block_sector_t
+index_run (const block_sector_t *idx, off_t ofs, off_t cnt)
+{
+  off_t i;
+  if (idx[ofs] == SECTOR_HOLE)
+    for (i = ofs + 1; i < cnt && idx[i] == SECTOR_HOLE; i++)
+      continue;
+  else
+    for (i = ofs + 1; i < cnt && idx[i] == idx[ofs] + (i - ofs); i++)
+      continue;
+  return i - ofs;
+}
+
+/* Get sector number from indirect index block at SECTOR, and store in
+   *RUN how many entries from OFS on map to consecutive sectors. A
+   missing index block is a run of holes to its end */
+static block_sector_t
+indirect_get_run (block_sector_t sector, off_t ofs, block_sector_t *run)
+{
+  if (sector == SECTOR_HOLE)
+  {
+    *run = IDX_PER_SECTOR - ofs;
+    return SECTOR_HOLE;
+  }
+  struct cache_entry *ce = cache_get (sector, false);
+  struct indirect_block *indirect_block = cache_data (ce);
   block_sector_t sec = indirect_block->idx[ofs];
-  free (indirect_block);
+  *run = index_run (indirect_block->idx, ofs, IDX_PER_SECTOR);
+  cache_put (ce);
   return sec;
 }
 
@@ -133,199 +281,693 @@ offset_double_indirect2 (off_t ofs)
   return (ofs - CAPACITY_L0) % CAPACITY_L1 / BLOCK_SECTOR_SIZE;
 }
 
+/* Returns the sector that contains byte offset POS within the
+   extent-mapped INODE_DISK, -1 if none does. */
+static block_sector_t
+extent_byte_to_sector (const struct inode_disk *inode_disk, off_t pos,
+                       block_sector_t *run)
+{
+  block_sector_t idx = pos / BLOCK_SECTOR_SIZE;
+  uint32_t i;
+  for (i = 0; i < inode_disk->extent_cnt; i++)
+  {
+    if (idx < inode_disk->extents[i].length)
+    {
+      *run = inode_disk->extents[i].length - idx;
+      return inode_disk->extents[i].start + idx;
+    }
+    idx -= inode_disk->extents[i].length;
+  }
+  *run = 0;
+  return -1;
+}
+
 /* Returns the block device sector number that contains byte offset POS
-   within INODE_DISK. Returns -1 if offset POS is beyond the ~8MB limit */
+   within INODE_DISK, and stores in *RUN how many sectors from there on
+   are consecutive on disk as well, as far as one index block goes.
+   Returns SECTOR_HOLE, with *RUN counting the holes, if POS was never
+   written. Returns -1 if offset POS is beyond the ~8MB limit */
 static block_sector_t
-byte_to_sector (const struct inode_disk *inode_disk, off_t pos) 
+byte_to_sector_run (const struct inode_disk *inode_disk, off_t pos,
+                    block_sector_t *run)
 {
+  if (inode_disk->magic == INODE_EXTENT_MAGIC)
+    return extent_byte_to_sector (inode_disk, pos, run);
   if (pos < CAPACITY_L0)
   {
     /* See the direct index array, element OFS */
     off_t ofs = offset_direct (pos);
+    *run = index_run (inode_disk->idx0, ofs, DIRECT_IDX_CNT);
     return inode_disk->idx0[ofs];   
   } 
   else if (pos < CAPACITY_L0 + CAPACITY_L1)
   {
     /* Search the indirect index array */
     off_t ofs_indirect = offset_indirect (pos);
-    return indirect_get_sector (inode_disk->idx1, ofs_indirect);
+    return indirect_get_run (inode_disk->idx1, ofs_indirect, run);
   }
   else if (pos < CAPACITY_L0 + CAPACITY_L1 + CAPACITY_L2)
   {
     /* Search the double indirect index array */
     off_t ofs_indirect = offset_double_indirect1 (pos);
     off_t ofs_double_indirect = offset_double_indirect2 (pos);
-    return indirect_get_sector (
+    return indirect_get_run (
         indirect_get_sector (inode_disk->idx2, ofs_indirect),
-        ofs_double_indirect);
+        ofs_double_indirect, run);
   }
+  *run = 0;
   return -1;
 }
 
-/* Allocate a new zero sector */
+/* Like byte_to_sector_run() on INODE's resident inode_disk, but answers from
+   INODE's cached run when it covers POS, so that a sequential pass walks
+   the index blocks once per run rather than once per sector. Sectors are
+   never remapped while the inode is open, so a cached run stays valid
+   as the file grows. Holes are not cached, since a write fills them */
 static block_sector_t
-allocate_zeroed_sector (void)
+inode_byte_to_sector (struct inode *inode, off_t pos)
 {
+  block_sector_t idx = pos / BLOCK_SECTOR_SIZE;
+  struct sector_run run;
   block_sector_t sector;
-  if (!free_map_allocate (1, &sector))
-    return -1;
-  char *zero = NULL;
-  zero = calloc (BLOCK_SECTOR_SIZE, sizeof *zero);
-  if (zero == NULL)
-    return -1;
-  memset(zero, 0, BLOCK_SECTOR_SIZE);
-  cache_write (sector, zero);
-  free (zero);  
+
+  lock_acquire (&inode->lock_xlate);
+  run = inode->xlate;
+  lock_release (&inode->lock_xlate);
+  if (idx >= run.first && idx - run.first < run.cnt)
+    return run.sector + (idx - run.first);
+
+  sector = byte_to_sector_run (&inode->data, pos, &run.cnt);
+  if (run.cnt > 0 && sector != SECTOR_HOLE)
+  {
+    run.first = idx;
+    run.sector = sector;
+    lock_acquire (&inode->lock_xlate);
+    inode->xlate = run;
+    lock_release (&inode->lock_xlate);
+  }
   return sector;
 }
 
-/* Allocate a new indirect block, fill the FIRST_ENTRY
-   as the first sector number */
-static block_sector_t
-allocate_indirect_block (off_t first_entry)
+/* Fill the CNT sectors starting at START with zeros. */
+static void
+zero_sectors (block_sector_t start, size_t cnt)
 {
-  block_sector_t sector;
-  if (!free_map_allocate (1, &sector))
-    return -1;  
-  struct indirect_block *indirect_blk = NULL;
-  indirect_blk = calloc (1, sizeof *indirect_blk);
-  if (indirect_blk == NULL)
-    return -1;
-  indirect_blk->idx[0] = first_entry;
-  cache_write (sector, indirect_blk);
-  free (indirect_blk);
-  return sector;
+  static const uint8_t zeros[BLOCK_SECTOR_SIZE];
+  size_t i;
+  for (i = 0; i < cnt; i++)
+    cache_write (start + i, zeros);
 }
 
-/* Allocate a new sector for the inode_disk, update length */
+/* If *SECTOR is a hole, allocate a zeroed index block into it, as close
+   after GOAL as possible. The sector is claimed from the *RESERVED
+   sectors reserved for it, if RESERVED is not null and there are any.
+   Returns false if the disk is full. */
 static bool
-inode_extend_single (struct inode_disk *inode_disk)
+allocate_index_block (block_sector_t *sector, block_sector_t goal,
+                      size_t *reserved)
 {
-  block_sector_t data_sector = allocate_zeroed_sector();
-  if ((int) data_sector == -1)
-  { 
+  block_sector_t new_sector;
+  if (*sector != SECTOR_HOLE)
+    return true;
+  if (reserved != NULL && *reserved > 0)
+  {
+    free_map_claim (goal, 1, &new_sector);
+    (*reserved)--;
+  }
+  else if (!free_map_allocate_near (goal, 1, &new_sector))
     return false;
+  zero_sectors (new_sector, 1);
+  *sector = new_sector;
+  return true;
+}
+
+/* Add CNT zeroed sectors to the end of the extent-mapped INODE_DISK,
+   growing its last extent in place if the sectors after it are free.
+   A new extent goes as close after the last one, or after the inode
+   sector for the first, as possible. */
+static bool
+extent_append (struct inode_disk *inode_disk, size_t cnt)
+{
+  struct extent *e;
+  block_sector_t start;
+  block_sector_t goal = inode_disk->sector + 1;
+  if (inode_disk->extent_cnt > 0)
+  {
+    e = &inode_disk->extents[inode_disk->extent_cnt - 1];
+    if (free_map_allocate_at (e->start + e->length, cnt))
+    {
+      zero_sectors (e->start + e->length, cnt);
+      e->length += cnt;
+      return true;
+    }
+    goal = e->start + e->length;
   }
-  off_t file_offset = inode_disk->length - 1;
-  inode_disk->length += BLOCK_SECTOR_SIZE;
-  /* Case 1: Add a block in the direct level */
-  if ( (file_offset + BLOCK_SECTOR_SIZE) < CAPACITY_L0)
+  if (inode_disk->extent_cnt == EXTENT_CNT
+      || !free_map_allocate_near (goal, cnt, &start))
+    return false;
+  zero_sectors (start, cnt);
+  e = &inode_disk->extents[inode_disk->extent_cnt++];
+  e->start = start;
+  e->length = cnt;
+  return true;
+}
+
+/* Extend the extent-mapped INODE_DISK to exactly LENGTH bytes. A file
+   that has to grow is given at least as many sectors again as it has,
+   up to EXTENT_GROW_MAX, so that a file written piece by piece still
+   ends up in a few long extents. If no free run is long enough, the
+   sectors are gathered from shorter ones. */
+static bool
+extent_extend_to_size (struct inode_disk *inode_disk, off_t length)
+{
+  size_t have = 0;
+  size_t need = DIV_ROUND_UP (length, BLOCK_SECTOR_SIZE);
+  uint32_t i;
+
+  for (i = 0; i < inode_disk->extent_cnt; i++)
+    have += inode_disk->extents[i].length;
+  if (need > have)
   {
-    off_t ofs = offset_direct (file_offset + BLOCK_SECTOR_SIZE);
-    inode_disk->idx0[ofs] = data_sector;
+    size_t want = need - have;
+    size_t grow = have < EXTENT_GROW_MAX ? have : EXTENT_GROW_MAX;
+    if (want >= grow || !extent_append (inode_disk, grow))
+      while (want > 0)
+      {
+        size_t run = want;
+        while (run > 0 && !extent_append (inode_disk, run))
+          run /= 2;
+        if (run == 0)
+          return false;
+        want -= run;
+      }
+  }
+  inode_disk->length = length;
+  return true;
+}
+
+/* Return all the sectors of the extent-mapped INODE_DISK to the free
+   map. */
+static void
+extent_release_all (const struct inode_disk *inode_disk)
+{
+  uint32_t i;
+  for (i = 0; i < inode_disk->extent_cnt; i++)
+    free_map_release (inode_disk->extents[i].start,
+                      inode_disk->extents[i].length);
+}
+
+/* Reserve up to NEED consecutive sectors for data of INODE, and store
+   the first into *START. Returns how many were reserved, 0 if the disk
+   is full. Sectors come from the inode's preallocation
+   window first; an inode without one opens a window of PREALLOC_SECTORS,
+   so that small appends do not each go to the free map. New sectors
+   are taken as close after GOAL as possible. */
+static size_t
+inode_take_sectors (struct inode *inode, size_t need, block_sector_t goal,
+                    block_sector_t *start)
+{
+  size_t cnt;
+  if (inode->prealloc_cnt > 0)
+  {
+    cnt = need < inode->prealloc_cnt ? need : inode->prealloc_cnt;
+    *start = inode->prealloc_start;
+    inode->prealloc_start += cnt;
+    inode->prealloc_cnt -= cnt;
+    return cnt;
+  }
+  if (need < PREALLOC_SECTORS
+      && free_map_allocate_near (goal, PREALLOC_SECTORS, start))
+  {
+    inode->prealloc_start = *start + need;
+    inode->prealloc_cnt = PREALLOC_SECTORS - need;
+    return need;
+  }
+  for (cnt = need; cnt > 0; cnt /= 2)
+    if (free_map_allocate_near (goal, cnt, start))
+      break;
+  return cnt;
+}
+
+/* Return INODE's unused preallocated sectors to the free map. */
+static void
+inode_release_prealloc (struct inode *inode)
+{
+  if (inode->prealloc_cnt > 0)
+    free_map_release (inode->prealloc_start, inode->prealloc_cnt);
+  inode->prealloc_cnt = 0;
+}
+
+/* Set entry OFS of the index block at SECTOR to DATA_SECTOR. */
+static void
+index_block_set (block_sector_t sector, off_t ofs, block_sector_t data_sector)
+{
+  struct cache_entry *ce = cache_get (sector, true);
+  struct indirect_block *blk = cache_data (ce);
+  blk->idx[ofs] = data_sector;
+  cache_mark_dirty (ce);
+  cache_put (ce);
+}
+
+/* Map byte POS of the indexed INODE, whose lock_inode is held, to
+   DATA_SECTOR, allocating the index blocks on the way, from the
+   *RESERVED reserved sectors first if RESERVED is not null. The inode
+   sector is written back if the resident inode_disk changed. Returns
+   false if the disk is full. */
+static bool
+inode_index_set (struct inode *inode, off_t pos, block_sector_t data_sector,
+                 size_t *reserved)
+{
+  struct inode_disk *inode_disk = &inode->data;
+  struct cache_entry *ce;
+  struct indirect_block *blk;
+  block_sector_t l2_sector;
+  bool ok;
+
+  /* Direct level */
+  if (pos < CAPACITY_L0)
+  {
+    inode_disk->idx0[offset_direct (pos)] = data_sector;
+    cache_write (inode->sector, inode_disk);
     return true;
-  } 
-  /* Case 2: Add a block in the indirect level */
-  else if ( (file_offset + BLOCK_SECTOR_SIZE) < CAPACITY_L0 + CAPACITY_L1)
+  }
+  /* Indirect level */
+  else if (pos < CAPACITY_L0 + CAPACITY_L1)
   {
-    /* Case 2.1: Need to allocate new indirect block */
-    if ( file_offset < CAPACITY_L0 )
+    if (inode_disk->idx1 == SECTOR_HOLE)
     {
-      block_sector_t indirect_sector;
-      indirect_sector = allocate_indirect_block (data_sector);
-      inode_disk->idx1 = indirect_sector;
-      return ((int)indirect_sector != -1);
-    } 
-    /* Case 2.2: No need to allocate new indirect block*/
-    else
-    {
-      off_t ofs = offset_indirect(file_offset + BLOCK_SECTOR_SIZE);
-      struct indirect_block *indirect_blk;
-      indirect_blk = malloc (sizeof *indirect_blk);
-      if (indirect_blk == NULL)
+      if (!allocate_index_block (&inode_disk->idx1, data_sector, reserved))
         return false;
-      cache_read (inode_disk->idx1, indirect_blk);
-      indirect_blk->idx[ofs] =  data_sector;
-      cache_write (inode_disk->idx1,indirect_blk);
-      free(indirect_blk);
-      return true;
-    }    
+      cache_write (inode->sector, inode_disk);
+    }
+    index_block_set (inode_disk->idx1, offset_indirect (pos), data_sector);
+    return true;
   }
-  /* Case 3: Add a block in the double-indirect level */
-  else if (file_offset + BLOCK_SECTOR_SIZE < CAPACITY_L0 +
-           CAPACITY_L1 + CAPACITY_L2)
+  /* Double indirect level */
+  else if (pos < CAPACITY_L0 + CAPACITY_L1 + CAPACITY_L2)
   {
-    /* Case 3.1: Need to allocate both indirect and double indirect blocks */
-    if ( file_offset < CAPACITY_L0 + CAPACITY_L1)
+    off_t ofs1 = offset_double_indirect1 (pos);
+    if (inode_disk->idx2 == SECTOR_HOLE)
     {
-      block_sector_t double_indirect_sector;
-      block_sector_t indirect_sector;
-      double_indirect_sector = allocate_indirect_block (data_sector);
-      indirect_sector = allocate_indirect_block(double_indirect_sector);
-      inode_disk->idx2 = indirect_sector;
-      return ((int)indirect_sector != -1 && (int)double_indirect_sector != -1);
-    } 
-    /* Case 3.2 No need to allocate first level indirect index block */
-    else
-    {
-      off_t ofs1 = offset_double_indirect1 (file_offset );
-      off_t ofs2 = offset_double_indirect1 (file_offset + BLOCK_SECTOR_SIZE);
-      struct indirect_block *indirect_blk;
-      indirect_blk = malloc (sizeof *indirect_blk);
-      if (indirect_blk == NULL)
+      if (!allocate_index_block (&inode_disk->idx2, data_sector, reserved))
         return false;
-      cache_read (inode_disk->idx2, indirect_blk);
-      /* Case 3.2.1: Need to allocate a double indirect index block */
-      if ( ofs1 != ofs2)
-      {
-        block_sector_t double_indirect_sector;
-        double_indirect_sector = allocate_indirect_block (data_sector);
-        indirect_blk->idx[ofs2] = double_indirect_sector;
-        cache_write (inode_disk->idx2, indirect_blk);
-        free (indirect_blk);
-        return ((int)double_indirect_sector != -1);
-      } 
-      /* Case 3.2.2: No need to allocate a double indirect index block */
-      else
-      {
-        off_t ofs_l2 = offset_double_indirect2(file_offset + BLOCK_SECTOR_SIZE);
-        struct indirect_block *double_indirect_blk;
-        double_indirect_blk = malloc (sizeof *double_indirect_blk);
-        if (double_indirect_blk == NULL)
-          return false;
-        cache_read (indirect_blk->idx[ofs1], double_indirect_blk);
-        double_indirect_blk->idx[ofs_l2] = data_sector;
-        cache_write (indirect_blk->idx[ofs1], double_indirect_blk);
-        free (indirect_blk);
-        free (double_indirect_blk);
-        return true;
-      }
+      cache_write (inode->sector, inode_disk);
     }
+    ce = cache_get (inode_disk->idx2, true);
+    blk = cache_data (ce);
+    l2_sector = blk->idx[ofs1];
+    ok = allocate_index_block (&blk->idx[ofs1], data_sector, reserved);
+    if (blk->idx[ofs1] != l2_sector)
+      cache_mark_dirty (ce);
+    l2_sector = blk->idx[ofs1];
+    cache_put (ce);
+    if (!ok)
+      return false;
+    index_block_set (l2_sector, offset_double_indirect2 (pos), data_sector);
+    return true;
+  }
+  /* Exceeds max file length */
+  return false;
+}
+
+/* Where a new data sector for byte POS of the indexed INODE should go:
+   right after the sector holding the previous file sector, or after the
+   inode sector if that one is a hole too. */
+static block_sector_t
+inode_data_goal (struct inode *inode, off_t pos)
+{
+  block_sector_t prev = SECTOR_HOLE;
+  if (pos >= BLOCK_SECTOR_SIZE)
+    prev = inode_byte_to_sector (inode, pos - BLOCK_SECTOR_SIZE);
+  return prev != SECTOR_HOLE ? prev + 1 : inode->sector + 1;
+}
+
+/* Back byte POS of the indexed INODE, a hole when last looked at, with
+   a sector and return it, or SECTOR_HOLE if the disk is full. The new
+   sector holds BUFFER if it is not null, else zeros, before it becomes
+   visible to readers; if another writer filled the hole meanwhile,
+   BUFFER is written to its sector instead. Takes lock_inode unless the
+   caller already holds it. */
+static block_sector_t
+inode_fill_hole (struct inode *inode, off_t pos, const void *buffer)
+{
+  bool held = lock_held_by_current_thread (&inode->lock_inode);
+  block_sector_t sector;
+
+  if (!held)
+    lock_acquire (&inode->lock_inode);
+  sector = inode_byte_to_sector (inode, pos);
+  if (sector != SECTOR_HOLE)
+  {
+    if (buffer != NULL)
+      cache_write (sector, buffer);
   }
-  /* Case 4: exceed max file length, return false */
+  else if (inode_take_sectors (inode, 1, inode_data_goal (inode, pos),
+                               &sector) == 0)
+    sector = SECTOR_HOLE;
   else
-    return false;
+  {
+    if (buffer != NULL)
+      cache_write (sector, buffer);
+    else
+      zero_sectors (sector, 1);
+    if (!inode_index_set (inode, pos, sector, NULL))
+    {
+      free_map_release (sector, 1);
+      sector = SECTOR_HOLE;
+    }
+  }
+  if (!held)
+    lock_release (&inode->lock_inode);
+  return sector;
 }
 
-/* Extend the length of the file to exactly LENGTH, possibly allocating
-   new blocks. */
+/* Return the unplaced block of INODE, whose lock_inode is held, that
+   holds file offset POS, or a null pointer. */
+static struct delayed_block *
+delayed_find (struct inode *inode, off_t pos)
+{
+  struct list_elem *e;
+  pos = ROUND_DOWN (pos, BLOCK_SECTOR_SIZE);
+  for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+       e = list_next (e))
+  {
+    struct delayed_block *db = list_entry (e, struct delayed_block, elem);
+    if (db->pos >= pos)
+      return db->pos == pos ? db : NULL;
+  }
+  return NULL;
+}
+
+/* Return true if INODE, whose lock_inode is held, has an unplaced
+   block at a file offset from START up to END. */
 static bool
-inode_extend_to_size (struct inode_disk *inode_disk, const off_t length)
+delayed_any (struct inode *inode, off_t start, off_t end)
 {
-  off_t extention = length - inode_disk->length;
-  off_t cur_left = ROUND_UP (inode_disk->length, BLOCK_SECTOR_SIZE)
-                   - inode_disk->length;
-  /* Case 1: no need to allocate new sectors */
-  if (extention <= cur_left)
+  struct list_elem *e;
+  for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+       e = list_next (e))
   {
-    inode_disk->length = length;
-    return true;
+    struct delayed_block *db = list_entry (e, struct delayed_block, elem);
+    if (db->pos >= start)
+      return db->pos < end;
+  }
+  return false;
+}
+
+/* Return how many index blocks mapping byte POS of the indexed INODE,
+   whose lock_inode is held, will allocate that are not already
+   reserved: those on the way to POS that are holes, unless an unplaced
+   block mapped through them has reserved them. */
+static size_t
+index_blocks_needed (struct inode *inode, off_t pos)
+{
+  struct inode_disk *inode_disk = &inode->data;
+  off_t base = CAPACITY_L0 + CAPACITY_L1;
+  size_t cnt = 0;
+
+  if (pos < CAPACITY_L0 || pos >= base + CAPACITY_L2)
+    return 0;
+  else if (pos < base)
+  {
+    if (inode_disk->idx1 == SECTOR_HOLE
+        && !delayed_any (inode, CAPACITY_L0, base))
+      cnt++;
   }
   else
   {
-    /* Case 2: need to allocate new sectors */
-    inode_disk->length = ROUND_UP (inode_disk->length, BLOCK_SECTOR_SIZE);
-    while (inode_disk->length < length)
+    off_t ofs1 = offset_double_indirect1 (pos);
+    off_t l2_start = base + ofs1 * CAPACITY_L1;
+    block_sector_t l2_sector = SECTOR_HOLE;
+    if (inode_disk->idx2 == SECTOR_HOLE)
     {
-      if (!inode_extend_single (inode_disk))
-      {
-        return false;
+      if (!delayed_any (inode, base, base + CAPACITY_L2))
+        cnt++;
+    }
+    else
+    {
+      struct cache_entry *ce = cache_get (inode_disk->idx2, false);
+      l2_sector = ((struct indirect_block *) cache_data (ce))->idx[ofs1];
+      cache_put (ce);
+    }
+    if (l2_sector == SECTOR_HOLE
+        && !delayed_any (inode, l2_start, l2_start + CAPACITY_L1))
+      cnt++;
+  }
+  return cnt;
+}
+
+/* Give every unplaced block of INODE, whose lock_inode is held, a
+   sector. The blocks are placed in file order, in as few runs of
+   their reserved sectors as the free map allows, and their index
+   blocks come out of the sectors reserved for them, so placing never
+   runs out of space. The inode stays in delayed_inodes; the caller
+   takes it out. */
+static void
+delayed_place (struct inode *inode)
+{
+  struct list_elem *e = list_begin (&inode->delayed);
+  while (e != list_end (&inode->delayed))
+  {
+    struct delayed_block *db = list_entry (e, struct delayed_block, elem);
+    block_sector_t start;
+    size_t cnt = free_map_claim (inode_data_goal (inode, db->pos),
+                                 inode->delayed_cnt, &start);
+    ASSERT (cnt > 0);
+    for (; cnt > 0; cnt--, start++)
+    {
+      db = list_entry (e, struct delayed_block, elem);
+      cache_write (start, db->data);
+      if (!inode_index_set (inode, db->pos, start,
+                            &inode->delayed_index_cnt))
+        PANIC ("no sector for the index of delayed data");
+      e = list_remove (e);
+      inode->delayed_cnt--;
+      free (db);
+    }
+  }
+  /* Index blocks allocated meanwhile by writes that filled holes
+     leave some of the reservation unused */
+  free_map_unreserve (inode->delayed_index_cnt);
+  inode->delayed_index_cnt = 0;
+}
+
+/* Throw away the unplaced blocks of INODE, whose lock_inode is held,
+   without ever allocating their sectors. */
+static void
+delayed_drop (struct inode *inode)
+{
+  while (!list_empty (&inode->delayed))
+    free (list_entry (list_pop_front (&inode->delayed),
+                      struct delayed_block, elem));
+  free_map_unreserve (inode->delayed_cnt + inode->delayed_index_cnt);
+  inode->delayed_cnt = 0;
+  inode->delayed_index_cnt = 0;
+}
+
+/* Write SIZE bytes from BUFFER at POS of the indexed INODE, in a sector
+   that was a hole when last looked at, to an unplaced block. The first
+   write to a hole reserves a sector for it and for the index blocks it
+   will need; an inode with DELAYED_MAX blocks places them first. If
+   the hole was given a sector meanwhile, the data goes there. Takes
+   lock_inode unless the caller already holds it. Returns false if the
+   disk is full. */
+static bool
+inode_delay_write (struct inode *inode, off_t pos, const void *buffer,
+                   off_t size)
+{
+  bool held = lock_held_by_current_thread (&inode->lock_inode);
+  struct delayed_block *db;
+  block_sector_t sector, run;
+  size_t index_cnt = 0;
+  bool success = true;
+  bool listed;
+
+  if (!held)
+    lock_acquire (&inode->lock_inode);
+  listed = inode->delayed_cnt > 0;
+  sector = byte_to_sector_run (&inode->data, pos, &run);
+  db = delayed_find (inode, pos);
+  if (sector == SECTOR_HOLE && db == NULL)
+  {
+    if (inode->delayed_cnt == DELAYED_MAX)
+      delayed_place (inode);
+    index_cnt = index_blocks_needed (inode, pos);
+  }
+  if (sector != SECTOR_HOLE)
+    cache_write_partial (sector, buffer, pos % BLOCK_SECTOR_SIZE, size);
+  else if (db != NULL)
+    memcpy (db->data + pos % BLOCK_SECTOR_SIZE, buffer, size);
+  else if ((db = calloc (1, sizeof *db)) == NULL)
+    success = false;
+  else if (!free_map_reserve (1 + index_cnt))
+  {
+    free (db);
+    success = false;
+  }
+  else
+  {
+    struct list_elem *e;
+    inode->delayed_index_cnt += index_cnt;
+    db->pos = ROUND_DOWN (pos, BLOCK_SECTOR_SIZE);
+    memcpy (db->data + pos % BLOCK_SECTOR_SIZE, buffer, size);
+    for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+         e = list_next (e))
+      if (list_entry (e, struct delayed_block, elem)->pos > db->pos)
         break;
-      }
+    list_insert (e, &db->elem);
+    inode->delayed_cnt++;
+    if (!listed)
+    {
+      inode->delayed_since = timer_ticks ();
+      lock_acquire (&lock_delayed);
+      list_push_back (&delayed_inodes, &inode->delayed_elem);
+      lock_release (&lock_delayed);
     }
-    inode_disk->length = length;
-    return true;
   }
+  /* Placing the blocks leaves the inode in delayed_inodes, with
+     nothing to flush if the write then failed */
+  if (listed && inode->delayed_cnt == 0)
+  {
+    lock_acquire (&lock_delayed);
+    list_remove (&inode->delayed_elem);
+    lock_release (&lock_delayed);
+  }
+  if (!held)
+    lock_release (&inode->lock_inode);
+  return success;
+}
+
+/* Read SIZE bytes at POS of INODE, in a sector that was a hole when
+   last looked at, into BUFFER: from the sector it was given meanwhile,
+   from its unplaced block if it has one, or else zeros. A block is
+   indexed before it leaves the unplaced list, so once the list is seen
+   empty the index alone tells, without the lock. */
+static void
+inode_read_hole (struct inode *inode, off_t pos, void *buffer, off_t size)
+{
+  bool unplaced = !list_empty (&inode->delayed);
+  struct delayed_block *db;
+  block_sector_t sector, run;
+
+  if (unplaced)
+    lock_acquire (&inode->lock_inode);
+  barrier ();
+  sector = byte_to_sector_run (&inode->data, pos, &run);
+  if (sector != SECTOR_HOLE)
+    cache_read_partial (sector, buffer, pos % BLOCK_SECTOR_SIZE, size);
+  else if (unplaced && (db = delayed_find (inode, pos)) != NULL)
+    memcpy (buffer, db->data + pos % BLOCK_SECTOR_SIZE, size);
+  else
+    memset (buffer, 0, size);
+  if (unplaced)
+    lock_release (&inode->lock_inode);
+}
+
+/* Give sectors to the unplaced data of every open inode that has held
+   some since before CUTOFF, in timer ticks. An inode whose lock is
+   busy is left for the next call. Returns false if any was left. */
+bool
+inode_flush_delayed (int64_t cutoff)
+{
+  struct list_elem *e;
+  bool done = true;
+  lock_acquire (&lock_delayed);
+  e = list_begin (&delayed_inodes);
+  while (e != list_end (&delayed_inodes))
+  {
+    struct inode *inode = list_entry (e, struct inode, delayed_elem);
+    if (inode->delayed_since <= cutoff
+        && lock_try_acquire (&inode->lock_inode))
+    {
+      delayed_place (inode);
+      e = list_remove (e);
+      lock_release (&inode->lock_inode);
+    }
+    else
+    {
+      done = done && inode->delayed_since > cutoff;
+      e = list_next (e);
+    }
+  }
+  lock_release (&lock_delayed);
+  return done;
+}
+
+/* Give sectors to all unplaced data, waiting for inodes that are
+   busy, as the file system shuts down. */
+void
+inode_flush_delayed_all (void)
+{
+  /* The flush only tries each inode's lock, since it holds
+     lock_delayed, which nests inside it */
+  while (!inode_flush_delayed (INT64_MAX))
+    timer_sleep (1);
+}
+
+/* Extend the length of the file to exactly LENGTH. Extent-mapped files
+   get their sectors now; an indexed file grows by holes, which are given
+   sectors when first written (see inode_fill_hole). */
+static bool
+inode_extend_to_size (struct inode_disk *inode_disk, const off_t length)
+{
+  if (inode_disk->magic == INODE_EXTENT_MAGIC)
+    return extent_extend_to_size (inode_disk, length);
+  if (length > CAPACITY_L0 + CAPACITY_L1 + CAPACITY_L2)
+    return false;
+  inode_disk->length = length;
+  return true;
+}
+
+/* Move the inline data of INODE, whose lock_inode is held, out to
+   sectors in the layout it was created for. The new layout is built
+   aside and its magic number stored last, so that a reader who sees
+   it finds the data in place. Returns false if memory or disk
+   allocation fails. */
+static bool
+inode_uninline (struct inode *inode)
+{
+  struct inode_disk *inode_disk = &inode->data;
+  struct inode_disk *blocks = calloc (1, sizeof *blocks);
+  uint8_t *data = calloc (1, BLOCK_SECTOR_SIZE);
+  block_sector_t run;
+  unsigned magic;
+  bool success = false;
+
+  if (blocks == NULL || data == NULL)
+    goto done;
+  blocks->sector = inode_disk->sector;
+  blocks->is_dir = inode_disk->is_dir;
+  blocks->magic = magic = inode_disk->grow_magic;
+  if (!inode_extend_to_size (blocks, inode_disk->length))
+  {
+    if (magic == INODE_EXTENT_MAGIC)
+      extent_release_all (blocks);
+    goto done;
+  }
+  if (blocks->length > 0)
+  {
+    /* An indexed file's first sector is written now rather than
+       left as a hole */
+    if (magic == INODE_MAGIC
+        && inode_take_sectors (inode, 1, inode->sector + 1,
+                               &blocks->idx0[0]) == 0)
+      goto done;
+    memcpy (data, inode_disk->inline_data, blocks->length);
+    cache_write (byte_to_sector_run (blocks, 0, &run), data);
+  }
+
+  blocks->magic = INODE_INLINE_MAGIC;
+  memcpy (inode_disk, blocks, sizeof *blocks);
+  barrier ();
+  inode_disk->magic = magic;
+  cache_write (inode->sector, inode_disk);
+  success = true;
+
+ done:
+  free (blocks);
+  free (data);
+  return success;
 }
 
 static block_sector_t
@@ -345,13 +987,50 @@ inode_hash_less (const struct hash_elem *a,
   return inode_a->sector < inode_b->sector;
 }
 
+/* Make inodes created from now on extent-mapped if EXTENTS is true,
+   else indexed. */
+void
+inode_set_extents (bool extents)
+{
+  use_extents = extents;
+}
+
+/* Keep writes to holes in memory until they are flushed if DELAYED is
+   true, else give them sectors right away. */
+void
+inode_set_delayed_alloc (bool delayed)
+{
+  delay_alloc = delayed;
+}
+
+/* Make inodes created from now on use the same layout as the inode
+   at SECTOR. */
+void
+inode_adopt_layout (block_sector_t sector)
+{
+  struct cache_entry *ce = cache_get (sector, false);
+  const struct inode_disk *inode_dsk = cache_data (ce);
+  unsigned magic = inode_dsk->magic;
+  if (magic == INODE_INLINE_MAGIC)
+    magic = inode_dsk->grow_magic;
+  use_extents = magic == INODE_EXTENT_MAGIC;
+  cache_put (ce);
+}
+
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
   hash_init (&open_inodes, inode_hash_func, inode_hash_less, NULL);
   lock_init (&lock_open_inodes);
+  list_init (&delayed_inodes);
+  lock_init (&lock_delayed);
+  list_init (&reclaim_queue);
+  lock_init (&lock_reclaim);
+  cond_init (&reclaim_ready);
+  cond_init (&reclaim_idle);
   cache_init();
+  thread_create ("reclaim", PRI_DEFAULT, reclaim_daemon, NULL);
 }
 
 /* Initializes an inode with LENGTH bytes of data and writes the new inode
@@ -373,11 +1052,24 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
   if (disk_inode == NULL)
     return false;
   disk_inode->length = 0;
-  inode_extend_to_size (disk_inode, length);
+  disk_inode->sector = sector;
+  disk_inode->magic = use_extents ? INODE_EXTENT_MAGIC : INODE_MAGIC;
+  if (length <= INLINE_CAPACITY)
+  {
+    /* Small enough to live in the inode sector, until it grows */
+    disk_inode->grow_magic = disk_inode->magic;
+    disk_inode->magic = INODE_INLINE_MAGIC;
+    disk_inode->length = length;
+  }
+  else if (!inode_extend_to_size (disk_inode, length))
+  {
+    if (disk_inode->magic == INODE_EXTENT_MAGIC)
+      extent_release_all (disk_inode);
+    free (disk_inode);
+    return false;
+  }
   ASSERT (disk_inode->length >= length);
   ASSERT (disk_inode->length-length < BLOCK_SECTOR_SIZE);
-  disk_inode->magic = INODE_MAGIC;
-  disk_inode->sector = sector;
   disk_inode->is_dir = is_dir ? 1 : 0;
   cache_write(sector, disk_inode);
   free (disk_inode);
@@ -418,19 +1110,20 @@ inode_open (block_sector_t sector)
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->to_be_removed = false;
+  inode->prealloc_cnt = 0;
+  inode->xlate.cnt = 0;
+  list_init (&inode->delayed);
+  inode->delayed_cnt = 0;
+  inode->delayed_index_cnt = 0;
+  lock_init (&inode->lock_xlate);
   lock_init (&inode->lock_inode);
   lock_init (&inode->lock_dir);
   hash_insert (&open_inodes, &inode->elem);
   lock_release (&lock_open_inodes);
 
-  struct inode_disk *inode_dsk;
-  inode_dsk = malloc (sizeof *inode_dsk);
-  if (inode_dsk == NULL)
-    return NULL;
-  cache_read (sector, inode_dsk);
-  inode->length = inode_dsk->length;
-  inode->is_dir = inode_dsk->is_dir != 0;
-  free (inode_dsk);
+  cache_read (sector, &inode->data);
+  inode->length = inode->data.length;
+  inode->is_dir = inode->data.is_dir != 0;
   return inode;
 }
 
@@ -450,45 +1143,158 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;
 }
 
+/* Sectors to release, gathered into runs so that the free map is
+   updated once per RELEASE_BATCH runs. */
+struct release_batch
+  {
+    struct free_run runs[RELEASE_BATCH];
+    size_t cnt;
+  };
+
+/* Release the sectors gathered in BATCH. */
 static void
-remove_inode (struct inode* inode)
+batch_flush (struct release_batch *batch)
 {
-  ASSERT (lock_held_by_current_thread (&inode->lock_inode));
-  struct inode_disk *inode_dsk;
-  inode_dsk = malloc (sizeof *inode_dsk);
-  if (inode_dsk == NULL)
-    PANIC ("couldn't allocate inode_disk!");
-  cache_read (inode->sector, inode_dsk);
-  off_t file_end = ROUND_UP (inode->length, BLOCK_SECTOR_SIZE);
-  off_t ofs;
-  block_sector_t sector;
+  if (batch->cnt > 0)
+    free_map_release_runs (batch->runs, batch->cnt);
+  batch->cnt = 0;
+}
 
-  /* Release the sectors for data block */
-  for (ofs = 0; ofs < file_end; ofs += BLOCK_SECTOR_SIZE)
+/* Add the CNT sectors starting at START to BATCH. */
+static void
+batch_add (struct release_batch *batch, block_sector_t start, size_t cnt)
+{
+  if (batch->cnt > 0)
   {
-    sector = byte_to_sector (inode_dsk, ofs);
-    free_map_release (sector, 1);
+    struct free_run *last = &batch->runs[batch->cnt - 1];
+    if (last->start + last->cnt == start)
+    {
+      last->cnt += cnt;
+      return;
+    }
   }
+  if (batch->cnt == RELEASE_BATCH)
+    batch_flush (batch);
+  batch->runs[batch->cnt].start = start;
+  batch->runs[batch->cnt].cnt = cnt;
+  batch->cnt++;
+}
+
+/* Release the inode at SECTOR, whose on-disk inode is INODE_DSK, and
+   all the sectors it maps. Index blocks are read before they are
+   released. */
+static void
+reclaim_sectors (block_sector_t sector, const struct inode_disk *inode_dsk)
+{
+  struct release_batch batch;
+  off_t file_end = ROUND_UP (inode_dsk->length, BLOCK_SECTOR_SIZE);
+  off_t ofs;
+  block_sector_t data_sector, cnt;
+  uint32_t i;
+
+  batch.cnt = 0;
 
-  /* Release the sector for indirect index block */
-  if ( inode->length >= CAPACITY_L0 )
-    free_map_release (inode_dsk->idx1, 1);
+  /* Release the extents, including sectors past the end of the file */
+  if (inode_dsk->magic == INODE_EXTENT_MAGIC)
+    for (i = 0; i < inode_dsk->extent_cnt; i++)
+      batch_add (&batch, inode_dsk->extents[i].start,
+                 inode_dsk->extents[i].length);
 
-  /* Release the sectors for double indirect index block */
-  if ( inode->length >= CAPACITY_L0 + CAPACITY_L1 )
+  /* Inline and extent-mapped data have no index to walk */
+  if (inode_dsk->magic == INODE_MAGIC)
   {
-    off_t idx;
-    struct indirect_block indirect_blk;
-    cache_read(inode_dsk->idx2, &indirect_blk);
-    for (idx = 0; idx < offset_double_indirect1(inode_dsk->length); idx++)
+    /* Release the sectors for data block, a run at a time, skipping
+       holes */
+    for (ofs = 0; ofs < file_end; ofs += cnt * BLOCK_SECTOR_SIZE)
     {
-      free_map_release (indirect_blk.idx[idx], 1);
+      data_sector = byte_to_sector_run (inode_dsk, ofs, &cnt);
+      if (cnt > (block_sector_t) (file_end - ofs) / BLOCK_SECTOR_SIZE)
+        cnt = (file_end - ofs) / BLOCK_SECTOR_SIZE;
+      if (data_sector != SECTOR_HOLE)
+        batch_add (&batch, data_sector, cnt);
+    }
+
+    /* Release the sector for indirect index block, if it was written */
+    if (inode_dsk->idx1 != SECTOR_HOLE)
+      batch_add (&batch, inode_dsk->idx1, 1);
+
+    /* Release the sectors for double indirect index block */
+    if (inode_dsk->idx2 != SECTOR_HOLE)
+    {
+      off_t idx;
+      struct indirect_block indirect_blk;
+      cache_read(inode_dsk->idx2, &indirect_blk);
+      for (idx = 0; idx < IDX_PER_SECTOR; idx++)
+      {
+        if (indirect_blk.idx[idx] != SECTOR_HOLE)
+          batch_add (&batch, indirect_blk.idx[idx], 1);
+      }
+      batch_add (&batch, inode_dsk->idx2, 1);
     }
-    free_map_release (inode_dsk->idx2, 1);
   }
-  free (inode_dsk);
   /* Release the sector for inode */
-  free_map_release (inode->sector, 1);
+  batch_add (&batch, sector, 1);
+  batch_flush (&batch);
+}
+
+/* Reclaimer thread: releases the sectors of queued removed inodes. */
+static void
+reclaim_daemon (void *aux UNUSED)
+{
+  lock_acquire (&lock_reclaim);
+  while (true)
+  {
+    struct reclaim *r;
+    while (list_empty (&reclaim_queue))
+      cond_wait (&reclaim_ready, &lock_reclaim);
+    r = list_entry (list_pop_front (&reclaim_queue), struct reclaim, elem);
+    reclaim_busy = true;
+    lock_release (&lock_reclaim);
+
+    reclaim_sectors (r->sector, &r->data);
+    free (r);
+
+    lock_acquire (&lock_reclaim);
+    reclaim_busy = false;
+    if (list_empty (&reclaim_queue))
+      cond_broadcast (&reclaim_idle, &lock_reclaim);
+  }
+}
+
+/* Wait until the reclaimer has released the sectors of every removed
+   inode. */
+void
+inode_reclaim_wait (void)
+{
+  lock_acquire (&lock_reclaim);
+  while (!list_empty (&reclaim_queue) || reclaim_busy)
+    cond_wait (&reclaim_idle, &lock_reclaim);
+  lock_release (&lock_reclaim);
+}
+
+/* Hand the sectors of INODE, which has been removed and closed by its
+   last opener, to the reclaimer. An inline inode, or one that cannot
+   be queued for lack of memory, is released right away. */
+static void
+remove_inode (struct inode* inode)
+{
+  ASSERT (lock_held_by_current_thread (&inode->lock_inode));
+  struct reclaim *r = NULL;
+
+  inode->xlate.cnt = 0;
+  if (inode->data.magic != INODE_INLINE_MAGIC)
+    r = malloc (sizeof *r);
+  if (r == NULL)
+  {
+    reclaim_sectors (inode->sector, &inode->data);
+    return;
+  }
+  r->sector = inode->sector;
+  r->data = inode->data;
+  lock_acquire (&lock_reclaim);
+  list_push_back (&reclaim_queue, &r->elem);
+  cond_signal (&reclaim_ready, &lock_reclaim);
+  lock_release (&lock_reclaim);
 }
 
 /* Closes INODE and writes it to disk.
@@ -510,7 +1316,21 @@ inode_close (struct inode *inode)
     hash_delete (&open_inodes, &inode->elem);
     lock_release (&lock_open_inodes);
 
+    /* Place data written under delayed allocation, or drop it without
+       ever touching the disk if the file is gone. */
+    if (inode->delayed_cnt > 0)
+    {
+      if (inode->to_be_removed)
+        delayed_drop (inode);
+      else
+        delayed_place (inode);
+      lock_acquire (&lock_delayed);
+      list_remove (&inode->delayed_elem);
+      lock_release (&lock_delayed);
+    }
+
     /* Deallocate blocks if removed. */
+    inode_release_prealloc (inode);
     if (inode->to_be_removed)
       remove_inode (inode);
     /* Remove the in-memory inode if open_cnt = 0 */
@@ -535,29 +1355,158 @@ inode_remove (struct inode *inode)
   lock_release (&inode->lock_inode);
 }
 
+/* Queue read-ahead for a read of [START, END) from INODE, whose
+   read-ahead state is RA.  A read that continues where the previous
+   one stopped doubles the window, up to RA_WINDOW_MAX sectors; any
+   other read collapses it.  Only sectors not queued before are sent. */
+static void
+inode_readahead (struct inode *inode, struct readahead *ra, off_t start,
+                 off_t end)
+{
+  block_sector_t sectors[RA_WINDOW_MAX];
+  size_t cnt = 0;
+  off_t ofs, target;
+
+  if (start == ra->next_ofs)
+  {
+    /* Sequential: grow the window */
+    if (ra->window == 0)
+      ra->window = RA_WINDOW_MIN;
+    else if (ra->window * 2 <= RA_WINDOW_MAX)
+      ra->window *= 2;
+  }
+  else
+  {
+    /* Random: drop the window and whatever was queued for the old stream */
+    ra->window = 0;
+    ra->queued_end = end;
+  }
+  ra->next_ofs = end;
+
+  target = ROUND_UP (end, BLOCK_SECTOR_SIZE)
+           + (off_t) ra->window * BLOCK_SECTOR_SIZE;
+  if (target > inode->length)
+    target = ROUND_UP (inode->length, BLOCK_SECTOR_SIZE);
+  ofs = ROUND_UP (end, BLOCK_SECTOR_SIZE);
+  if (ofs < ra->queued_end)
+    ofs = ra->queued_end;
+  for (; ofs < target && cnt < RA_WINDOW_MAX; ofs += BLOCK_SECTOR_SIZE)
+  {
+    block_sector_t sector = inode_byte_to_sector (inode, ofs);
+    if (sector != SECTOR_HOLE)
+      sectors[cnt++] = sector;
+  }
+  if (ofs > ra->queued_end)
+    ra->queued_end = ofs;
+  if (cnt > 0)
+    cache_readahead_multiple (sectors, cnt);
+}
+
+/* A position in the bytes of an array of buffers. */
+struct iov_iter
+  {
+    const struct iovec *iov;            /* Current buffer. */
+    size_t ofs;                         /* Offset within it. */
+  };
+
+/* Return the next byte of IT, skipping empty buffers, and lower *SIZE
+   to the bytes left in its buffer. There must be a byte left. */
+static uint8_t *
+iov_iter_span (struct iov_iter *it, off_t *size)
+{
+  while (it->ofs == it->iov->iov_len)
+  {
+    it->iov++;
+    it->ofs = 0;
+  }
+  if ((size_t) *size > it->iov->iov_len - it->ofs)
+    *size = it->iov->iov_len - it->ofs;
+  return (uint8_t *) it->iov->iov_base + it->ofs;
+}
+
+/* Return the total length of the CNT buffers of IOV. */
+static off_t
+iov_length (const struct iovec *iov, int cnt)
+{
+  off_t size = 0;
+  int i;
+  for (i = 0; i < cnt; i++)
+    size += iov[i].iov_len;
+  return size;
+}
+
+/* Reads up to SIZE bytes at OFFSET, which is within the file, into the
+   buffers at IT if INODE still holds its data inline, and stores the
+   count into *BYTES_READ. Returns false if the data has moved out to
+   sectors. */
+static bool
+inode_read_inline (struct inode *inode, struct iov_iter *it, off_t size,
+                   off_t offset, off_t *bytes_read)
+{
+  bool is_inline;
+  lock_acquire (&inode->lock_inode);
+  is_inline = inode->data.magic == INODE_INLINE_MAGIC;
+  if (is_inline)
+  {
+    if (size > inode->data.length - offset)
+      size = inode->data.length - offset;
+    *bytes_read = 0;
+    while (*bytes_read < size)
+    {
+      off_t chunk = size - *bytes_read;
+      uint8_t *buffer = iov_iter_span (it, &chunk);
+      memcpy (buffer, inode->data.inline_data + offset + *bytes_read, chunk);
+      it->ofs += chunk;
+      *bytes_read += chunk;
+    }
+  }
+  lock_release (&inode->lock_inode);
+  return is_inline;
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
-off_t         
-inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
+off_t
+inode_read_at (struct inode *inode, void *buffer, off_t size, off_t offset)
+{
+  return inode_read_at_ra (inode, buffer, size, offset, NULL);
+}
+
+/* Like inode_read_at(), but drives read-ahead from RA, the read-ahead
+   state of the open file being read.  If RA is null, only the sector
+   following the read is prefetched. */
+off_t
+inode_read_at_ra (struct inode *inode, void *buffer, off_t size,
+                  off_t offset, struct readahead *ra)
 {
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+  return inode_readv_at (inode, &iov, 1, offset, ra);
+}
+
+/* Like inode_read_at_ra(), but reads into the CNT buffers of IOV in
+   turn, as if they were one. */
+off_t
+inode_readv_at (struct inode *inode, const struct iovec *iov, int cnt,
+                off_t offset, struct readahead *ra)
+{
+  off_t start = offset;
   if (offset >= inode->length)
   {
     return 0;
   }
-  uint8_t *buffer = buffer_;
+  struct iov_iter it = { iov, 0 };
+  off_t size = iov_length (iov, cnt);
   off_t bytes_read = 0;
-  struct inode_disk *inode_dsk;
-  inode_dsk = malloc (sizeof *inode_dsk);
-  if (inode_dsk == NULL)
-  {
-    return 0;
-  }
-  cache_read (inode->sector, inode_dsk);
+  if (inode->data.magic == INODE_INLINE_MAGIC
+      && inode_read_inline (inode, &it, size, offset, &bytes_read))
+    return bytes_read;
   while (size > 0) 
   {
     /* Disk sector to read, starting byte offset within sector. */
-    block_sector_t sector_idx = byte_to_sector (inode_dsk, offset);
+    block_sector_t sector_idx = inode_byte_to_sector (inode, offset);
     int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
     /* Bytes left in inode, bytes left in sector, lesser of the two.
@@ -567,36 +1516,45 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
     int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
     int min_left = inode_left < sector_left ? inode_left : sector_left;
 
-    /* Number of bytes to actually copy out of this sector. */
-    int bytes_to_read = size < min_left ? size : min_left;
+    /* Number of bytes to actually copy out of this sector, into the
+       current buffer. */
+    off_t bytes_to_read = size < min_left ? size : min_left;
     if (bytes_to_read <= 0)
       break;
+    uint8_t *buffer = iov_iter_span (&it, &bytes_to_read);
 
-    if (sector_ofs == 0 && bytes_to_read == BLOCK_SECTOR_SIZE)
+    if (sector_idx == SECTOR_HOLE)
+    {
+      /* Never placed: unplaced data or zeros, without I/O. */
+      inode_read_hole (inode, offset, buffer, bytes_to_read);
+    }
+    else if (sector_ofs == 0 && bytes_to_read == BLOCK_SECTOR_SIZE)
     {
       /* Read full sector directly into caller's buffer. */
-      cache_read (sector_idx, buffer + bytes_read);
+      cache_read (sector_idx, buffer);
     }
     else
     {
       /* Read sector and partially copy into caller's buffer */
-      cache_read_partial (sector_idx, buffer + bytes_read,
-                          sector_ofs, bytes_to_read);
+      cache_read_partial (sector_idx, buffer, sector_ofs, bytes_to_read);
     }
 
     /* Advance. */
+    it.ofs += bytes_to_read;
     size -= bytes_to_read;
     offset += bytes_to_read;
     bytes_read += bytes_to_read;
   }
+  if (ra != NULL)
+    inode_readahead (inode, ra, start, offset);
   /* If there are still contents to read, then prefetch a sector. */
-  if ( offset + BLOCK_SECTOR_SIZE < inode->length)
+  else if ( offset + BLOCK_SECTOR_SIZE < inode->length)
   {
     block_sector_t sector_prefetch =
-      byte_to_sector (inode_dsk, offset + BLOCK_SECTOR_SIZE);
-    cache_readahead(sector_prefetch);
+      inode_byte_to_sector (inode, offset + BLOCK_SECTOR_SIZE);
+    if (sector_prefetch != SECTOR_HOLE)
+      cache_readahead(sector_prefetch);
   }
-  free (inode_dsk);
   return bytes_read;
 }
 
@@ -604,16 +1562,26 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs. */
 off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
+inode_write_at (struct inode *inode, const void *buffer, off_t size,
                 off_t offset) 
 {
-  const uint8_t *buffer = buffer_;
+  struct iovec iov;
+  iov.iov_base = (void *) buffer;
+  iov.iov_len = size;
+  return inode_writev_at (inode, &iov, 1, offset);
+}
+
+/* Like inode_write_at(), but writes the CNT buffers of IOV in turn, as
+   if they were one.  The lock is held for the whole of a vector of more
+   than one buffer, so no other extension lands between its pieces. */
+off_t
+inode_writev_at (struct inode *inode, const struct iovec *iov, int cnt,
+                 off_t offset)
+{
+  struct iov_iter it = { iov, 0 };
+  off_t size = iov_length (iov, cnt);
   off_t bytes_written = 0;
-  struct inode_disk *inode_dsk;
-  inode_dsk = malloc (sizeof *inode_dsk);
-  if (inode_dsk == NULL)
-    return 0;
-  cache_read (inode->sector, inode_dsk);
+  struct inode_disk *inode_dsk = &inode->data;
 
   if (inode->deny_write_cnt)
     return 0;
@@ -624,22 +1592,54 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
      all the data is written. */
   lock_acquire (&inode->lock_inode);
 
+  /* Inline data is written in place while it fits, and moved out to
+     sectors once the file outgrows the inode sector */
+  if (inode_dsk->magic == INODE_INLINE_MAGIC)
+  {
+    if (offset + size <= INLINE_CAPACITY)
+    {
+      while (bytes_written < size)
+      {
+        off_t chunk = size - bytes_written;
+        const uint8_t *buffer = iov_iter_span (&it, &chunk);
+        memcpy (inode_dsk->inline_data + offset + bytes_written, buffer,
+                chunk);
+        it.ofs += chunk;
+        bytes_written += chunk;
+      }
+      if (inode_dsk->length < offset + size)
+        inode_dsk->length = offset + size;
+      inode->length = inode_dsk->length;
+      cache_write (inode->sector, inode_dsk);
+      lock_release (&inode->lock_inode);
+      return size;
+    }
+    if (!inode_uninline (inode))
+    {
+      lock_release (&inode->lock_inode);
+      return 0;
+    }
+  }
+
   /* If total bytes to be written is larger than current file length,
      need to extend the file to (offset + size). Don't release the lock
-     until finish extending and writing the file. */
+     until finish extending and writing the file. The resident copy of
+     the on-disk inode is extended, then written back to its sector; a
+     write within the file leaves the inode sector alone. */
   bool need_extension = false;
   if (offset + size > inode_dsk->length)
   {
     need_extension = true;
-    if( !inode_extend_to_size (inode_dsk, offset + size ))
+    bool extended = inode_extend_to_size (inode_dsk, offset + size);
+    cache_write (inode->sector, inode_dsk);
+    if (!extended)
     {
       lock_release (&inode->lock_inode);
-      free(inode_dsk);
       return 0;
     }
     /* Note: inode->length is not updated until a sector of data is written */
   }
-  else
+  else if (cnt == 1)
   {
     /* No need to hold the lock if data to write does not exceed the EOF */
     lock_release (&inode->lock_inode);
@@ -648,7 +1648,7 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   while (size > 0)
   {
     /* Sector to write, starting byte offset within sector. */
-    block_sector_t sector_idx = byte_to_sector (inode_dsk, offset);
+    block_sector_t sector_idx = inode_byte_to_sector (inode, offset);
     int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
     /* Make sure enough space to write data */
@@ -658,26 +1658,45 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     /* Bytes left in inode, bytes left in sector, lesser of the two. */
     int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
 
-    /* Number of bytes to actually write into this sector. */
-    int bytes_to_write = size < sector_left ? size : sector_left;
+    /* Number of bytes to actually write into this sector, from the
+       current buffer. */
+    off_t bytes_to_write = size < sector_left ? size : sector_left;
     if (bytes_to_write <= 0)
       break;
+    const uint8_t *buffer = iov_iter_span (&it, &bytes_to_write);
 
-    if (sector_ofs == 0 && bytes_to_write == BLOCK_SECTOR_SIZE)
+    if (sector_idx == SECTOR_HOLE && delay_alloc)
+    {
+      /* Keep it in memory; it gets a sector when flushed. */
+      if (!inode_delay_write (inode, offset, buffer, bytes_to_write))
+        break;
+    }
+    else if (sector_idx == SECTOR_HOLE)
+    {
+      /* First write to a hole: back it with a sector, which gets the
+         data right away if the write covers it, else zeros. */
+      bool full = sector_ofs == 0 && bytes_to_write == BLOCK_SECTOR_SIZE;
+      sector_idx = inode_fill_hole (inode, offset, full ? buffer : NULL);
+      if (sector_idx == SECTOR_HOLE)
+        break;
+      if (!full)
+        cache_write_partial (sector_idx, buffer, sector_ofs, bytes_to_write);
+    }
+    else if (sector_ofs == 0 && bytes_to_write == BLOCK_SECTOR_SIZE)
     {
       /* Write a full sector. */
-      cache_write (sector_idx, buffer + bytes_written);
+      cache_write (sector_idx, buffer);
     }
     else
     {
       /* If the sector contains data before or after the chunk
          we're writing, then we need to read in the sector
          first.  Otherwise we start with a sector of all zeros. */
-      cache_write_partial (sector_idx, buffer + bytes_written,
-                           sector_ofs, bytes_to_write);
+      cache_write_partial (sector_idx, buffer, sector_ofs, bytes_to_write);
     }
 
     /* Advance. */
+    it.ofs += bytes_to_write;
     size -= bytes_to_write;
     offset += bytes_to_write;
     bytes_written += bytes_to_write;
@@ -687,12 +1706,9 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       inode->length = offset;
   }
 
-  if (need_extension)
+  if (need_extension || cnt > 1)
     lock_release (&inode->lock_inode);
 
-  ASSERT (inode->sector == inode_dsk->sector);
-  cache_write (inode->sector, inode_dsk);
-  free (inode_dsk);
   return bytes_written;
 }
 
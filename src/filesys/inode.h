@@ -2,12 +2,28 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
 struct bitmap;
+struct iovec;
+
+/* Sequential read-ahead state, kept per open file. */
+struct readahead
+  {
+    off_t next_ofs;             /* Offset a sequential reader reads next. */
+    off_t queued_end;           /* End of the range already queued. */
+    size_t window;              /* Sectors to keep queued ahead. */
+  };
 
 void inode_init (void);
+void inode_set_extents (bool);
+void inode_set_delayed_alloc (bool);
+bool inode_flush_delayed (int64_t cutoff);
+void inode_flush_delayed_all (void);
+void inode_reclaim_wait (void);
+void inode_adopt_layout (block_sector_t);
 bool inode_create (block_sector_t, off_t, bool);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
@@ -15,7 +31,13 @@ block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+off_t inode_read_at_ra (struct inode *, void *, off_t size, off_t offset,
+                        struct readahead *);
+off_t inode_readv_at (struct inode *, const struct iovec *, int cnt,
+                      off_t offset, struct readahead *);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_writev_at (struct inode *, const struct iovec *, int cnt,
+                       off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
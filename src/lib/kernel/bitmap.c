@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include <string.h>
 #include "threads/malloc.h"
 #include "filesys/file.h"
 
@@ -356,6 +357,22 @@ bitmap_write (const struct bitmap *b, struct file *file)
   return file_write_at (file, b->bits, size, 0) == size;
 }
 
+/* Copies bytes OFS through OFS + SIZE (exclusive) of B, as
+   stored by bitmap_write(), into DST.  The range is clipped to
+   the end of B.  Returns the number of bytes copied. */
+size_t
+bitmap_copy_bytes (const struct bitmap *b, size_t ofs, void *dst,
+                   size_t size)
+{
+  size_t file_size = byte_cnt (b->bit_cnt);
+  if (ofs >= file_size)
+    return 0;
+  if (size > file_size - ofs)
+    size = file_size - ofs;
+  memcpy (dst, (const uint8_t *) b->bits + ofs, size);
+  return size;
+}
+
 /* Debugging. */
 
 /* Dumps the contents of B to the console as hexadecimal. */
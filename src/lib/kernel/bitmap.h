@@ -42,6 +42,8 @@ struct file;
 size_t bitmap_file_size (const struct bitmap *);
 bool bitmap_read (struct bitmap *, struct file *);
 bool bitmap_write (const struct bitmap *, struct file *);
+size_t bitmap_copy_bytes (const struct bitmap *, size_t ofs, void *,
+                          size_t size);
 
 /* Debugging. */
 void bitmap_dump (const struct bitmap *);
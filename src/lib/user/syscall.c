@@ -61,6 +61,25 @@
           retval;                                               \
         })
 
+/* Invokes syscall NUMBER, passing arguments ARG0, ARG1, ARG2,
+   and ARG3, and returns the return value as an `int'. */
+#define syscall4(NUMBER, ARG0, ARG1, ARG2, ARG3)                \
+        ({                                                      \
+          int retval;                                           \
+          asm volatile                                          \
+            ("pushl %[arg3]; pushl %[arg2]; "                   \
+             "pushl %[arg1]; pushl %[arg0]; "                   \
+             "pushl %[number]; int $0x30; addl $20, %%esp"      \
+               : "=a" (retval)                                  \
+               : [number] "i" (NUMBER),                         \
+                 [arg0] "r" (ARG0),                             \
+                 [arg1] "r" (ARG1),                             \
+                 [arg2] "r" (ARG2),                             \
+                 [arg3] "r" (ARG3)                              \
+               : "memory");                                     \
+          retval;                                               \
+        })
+
 void
 halt (void) 
 {
@@ -123,6 +142,30 @@ write (int fd, const void *buffer, unsigned size)
   return syscall3 (SYS_WRITE, fd, buffer, size);
 }
 
+int
+pread (int fd, void *buffer, unsigned size, unsigned position)
+{
+  return syscall4 (SYS_PREAD, fd, buffer, size, position);
+}
+
+int
+pwrite (int fd, const void *buffer, unsigned size, unsigned position)
+{
+  return syscall4 (SYS_PWRITE, fd, buffer, size, position);
+}
+
+int
+readv (int fd, const struct iovec *iov, int cnt)
+{
+  return syscall3 (SYS_READV, fd, iov, cnt);
+}
+
+int
+writev (int fd, const struct iovec *iov, int cnt)
+{
+  return syscall3 (SYS_WRITEV, fd, iov, cnt);
+}
+
 void
 seek (int fd, unsigned position) 
 {
@@ -171,6 +214,12 @@ readdir (int fd, char name[READDIR_MAX_LEN + 1])
   return syscall2 (SYS_READDIR, fd, name);
 }
 
+int
+readdirs (int fd, struct readdir_entry *entries, size_t cnt)
+{
+  return syscall3 (SYS_READDIRS, fd, entries, cnt);
+}
+
 bool
 isdir (int fd) 
 {
@@ -182,3 +231,9 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+cachestat (struct cache_stats *stats)
+{
+  return syscall1 (SYS_CACHESTAT, stats);
+}
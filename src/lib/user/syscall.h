@@ -2,6 +2,7 @@
 #define __LIB_USER_SYSCALL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <debug.h>
 
 /* Process identifier. */
@@ -15,6 +16,39 @@ typedef int mapid_t;
 /* Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
+/* A directory entry, as returned by readdirs(). */
+struct readdir_entry
+  {
+    char name[READDIR_MAX_LEN + 1];     /* Null terminated file name. */
+    bool is_dir;                        /* Directory or file? */
+    int inumber;                        /* Inode number. */
+    int size;                           /* Length in bytes. */
+  };
+
+/* A buffer for readv() and writev(), which take at most IOV_MAX. */
+struct iovec
+  {
+    void *iov_base;                     /* Start of the buffer. */
+    size_t iov_len;                     /* Its length in bytes. */
+  };
+#define IOV_MAX 64
+
+/* Buffer cache counters, as returned by cachestat(). */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Lookups that found the sector. */
+    unsigned long long misses;          /* Lookups that read the disk. */
+    unsigned long long ra_hits;         /* Prefetched sectors used. */
+    unsigned long long ra_wasted;       /* Prefetched sectors evicted unused. */
+    unsigned long long evict_clean;     /* Clean sectors evicted. */
+    unsigned long long evict_dirty;     /* Dirty sectors evicted. */
+    unsigned long long waits;           /* Waits for a busy sector. */
+    unsigned long long wait_ticks;      /* Timer ticks spent waiting. */
+    unsigned long long flush_batches;   /* Write-back requests. */
+    unsigned long long flush_sectors;   /* Sectors written back by them. */
+    unsigned long long flush_batch_max; /* Largest request, in sectors. */
+  };
+
 /* Typical return values from main() and arguments to exit(). */
 #define EXIT_SUCCESS 0          /* Successful execution. */
 #define EXIT_FAILURE 1          /* Unsuccessful execution. */
@@ -30,7 +64,11 @@ int open (const char *file);
 int filesize (int fd);
 int read (int fd, void *buffer, unsigned length);
 int write (int fd, const void *buffer, unsigned length);
+int readv (int fd, const struct iovec *, int cnt);
+int writev (int fd, const struct iovec *, int cnt);
 void seek (int fd, unsigned position);
+int pread (int fd, void *buffer, unsigned length, unsigned position);
+int pwrite (int fd, const void *buffer, unsigned length, unsigned position);
 unsigned tell (int fd);
 void close (int fd);
 
@@ -42,7 +80,9 @@ void munmap (mapid_t);
 bool chdir (const char *dir);
 bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
+int readdirs (int fd, struct readdir_entry *, size_t cnt);
 bool isdir (int fd);
 int inumber (int fd);
+bool cachestat (struct cache_stats *);
 
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,33 @@
+/* Writes a file, then reads it back and checks that cachestat()
+   counts the read as buffer cache hits. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[512];
+
+void
+test_main (void) 
+{
+  struct cache_stats before, after;
+  int fd;
+
+  memset (buf, 'a', sizeof buf);
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK ((fd = open ("a")) > 1, "open \"a\"");
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf, "write \"a\"");
+
+  CHECK (cachestat (&before), "cachestat");
+  seek (fd, 0);
+  CHECK (read (fd, buf, sizeof buf) == (int) sizeof buf, "read \"a\"");
+  CHECK (cachestat (&after), "cachestat");
+
+  if (after.hits <= before.hits)
+    fail ("reading a cached sector did not count a hit");
+  if (after.misses < before.misses)
+    fail ("miss count went backwards");
+  msg ("close \"a\"");
+  close (fd);
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-stat) begin
+(cache-stat) create "a"
+(cache-stat) open "a"
+(cache-stat) write "a"
+(cache-stat) cachestat
+(cache-stat) read "a"
+(cache-stat) cachestat
+(cache-stat) close "a"
+(cache-stat) end
+EOF
+pass;
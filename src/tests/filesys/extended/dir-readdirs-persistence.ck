@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($fs);
+$fs->{'d'}{"f$_"} = ["\0" x $_] foreach 0...49;
+$fs->{'d'}{'sub'} = {};
+check_archive ($fs);
+pass;
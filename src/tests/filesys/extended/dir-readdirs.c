@@ -0,0 +1,94 @@
+/* Fills a directory with enough entries to span several hash
+   buckets, then lists it with readdirs() a few entries at a
+   time, checking that every entry is returned exactly once with
+   the right type, inode number, and size. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 50
+#define BATCH 7
+
+static bool seen[FILE_CNT];
+
+static void
+check_entry (const struct readdir_entry *e, bool *saw_sub) 
+{
+  char name[sizeof e->name + 2];
+  int fd, i;
+
+  snprintf (name, sizeof name, "d/%.*s", READDIR_MAX_LEN, e->name);
+  if ((fd = open (name)) < 2)
+    fail ("readdirs returned \"%s\", which cannot be opened", e->name);
+  if (e->inumber != inumber (fd))
+    fail ("\"%s\" has inumber %d, readdirs said %d",
+          e->name, inumber (fd), e->inumber);
+  if (e->is_dir != isdir (fd))
+    fail ("readdirs got the type of \"%s\" wrong", e->name);
+  close (fd);
+
+  if (e->is_dir) 
+    {
+      if (strcmp (e->name, "sub") || *saw_sub)
+        fail ("unexpected directory \"%s\"", e->name);
+      *saw_sub = true;
+      return;
+    }
+
+  i = atoi (e->name + 1);
+  if (e->name[0] != 'f' || i < 0 || i >= FILE_CNT)
+    fail ("unexpected file \"%s\"", e->name);
+  if (seen[i])
+    fail ("\"%s\" returned twice", e->name);
+  if (e->size != i)
+    fail ("\"%s\" has size %d, readdirs said %d", e->name, i, e->size);
+  seen[i] = true;
+}
+
+void
+test_main (void) 
+{
+  struct readdir_entry entries[BATCH];
+  bool saw_sub = false;
+  int fd, file_fd, cnt, total, i;
+
+  CHECK (mkdir ("d"), "mkdir \"d\"");
+  msg ("creating %d files in \"d\"", FILE_CNT);
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      char name[16];
+      snprintf (name, sizeof name, "d/f%d", i);
+      if (!create (name, i))
+        fail ("create \"%s\"", name);
+    }
+  CHECK (mkdir ("d/sub"), "mkdir \"d/sub\"");
+
+  CHECK ((fd = open ("d")) > 1, "open \"d\"");
+  msg ("readdirs \"d\", %d entries at a time", BATCH);
+  total = 0;
+  while ((cnt = readdirs (fd, entries, BATCH)) > 0) 
+    {
+      if (cnt > BATCH)
+        fail ("readdirs returned %d entries for room for %d", cnt, BATCH);
+      for (i = 0; i < cnt; i++)
+        check_entry (&entries[i], &saw_sub);
+      total += cnt;
+    }
+  if (cnt < 0)
+    fail ("readdirs \"d\" returned %d", cnt);
+  if (total != FILE_CNT + 1 || !saw_sub)
+    fail ("readdirs returned %d entries, expected %d", total, FILE_CNT + 1);
+  CHECK (readdirs (fd, entries, BATCH) == 0, "readdirs at end returns 0");
+  msg ("close \"d\"");
+  close (fd);
+
+  CHECK ((file_fd = open ("d/f1")) > 1, "open \"d/f1\"");
+  CHECK (readdirs (file_fd, entries, BATCH) == -1,
+         "readdirs \"d/f1\" (must return -1)");
+  msg ("close \"d/f1\"");
+  close (file_fd);
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-readdirs) begin
+(dir-readdirs) mkdir "d"
+(dir-readdirs) creating 50 files in "d"
+(dir-readdirs) mkdir "d/sub"
+(dir-readdirs) open "d"
+(dir-readdirs) readdirs "d", 7 entries at a time
+(dir-readdirs) readdirs at end returns 0
+(dir-readdirs) close "d"
+(dir-readdirs) open "d/f1"
+(dir-readdirs) readdirs "d/f1" (must return -1)
+(dir-readdirs) close "d/f1"
+(dir-readdirs) end
+EOF
+pass;
@@ -0,0 +1,6 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({'p' => [join ('', map (chr ($_ % 251), 0...1023))]});
+pass;
@@ -0,0 +1,67 @@
+/* Checks that pread() and pwrite() transfer data at the given
+   position without moving the file position, that pread()
+   comes up short at end of file, and that both reject bad file
+   descriptors. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[1024];
+static char data[1024];
+
+static void
+check_tell (int fd) 
+{
+  unsigned pos = tell (fd);
+  if (pos != 0)
+    fail ("file position moved to %u", pos);
+}
+
+void
+test_main (void) 
+{
+  int fd, retval;
+  size_t i;
+
+  for (i = 0; i < sizeof data; i++)
+    data[i] = i % 251;
+
+  CHECK (create ("p", 0), "create \"p\"");
+  CHECK ((fd = open ("p")) > 1, "open \"p\"");
+
+  /* Write the second half first, to grow the file past a hole. */
+  retval = pwrite (fd, data + 512, 512, 512);
+  CHECK (retval == 512, "pwrite 512 bytes at 512 (returned %d)", retval);
+  check_tell (fd);
+  retval = pwrite (fd, data, 512, 0);
+  CHECK (retval == 512, "pwrite 512 bytes at 0 (returned %d)", retval);
+  check_tell (fd);
+
+  retval = pread (fd, buf, 300, 400);
+  CHECK (retval == 300, "pread 300 bytes at 400 (returned %d)", retval);
+  compare_bytes (buf, data + 400, 300, 400, "p");
+  check_tell (fd);
+
+  retval = pread (fd, buf, 200, 900);
+  CHECK (retval == 124, "pread across end of file (returned %d)", retval);
+  compare_bytes (buf, data + 900, 124, 900, "p");
+  retval = pread (fd, buf, 200, 2000);
+  CHECK (retval == 0, "pread past end of file (returned %d)", retval);
+  check_tell (fd);
+
+  retval = read (fd, buf, sizeof buf);
+  CHECK (retval == (int) sizeof buf, "read whole file (returned %d)", retval);
+  compare_bytes (buf, data, sizeof buf, 0, "p");
+
+  CHECK (pread (0, buf, 10, 0) == -1, "pread fd 0 (must return -1)");
+  CHECK (pwrite (1, buf, 10, 0) == -1, "pwrite fd 1 (must return -1)");
+  CHECK (pread (0x20101234, buf, 10, 0) == -1,
+         "pread bad fd (must return -1)");
+  CHECK (pwrite (0x20101234, buf, 10, 0) == -1,
+         "pwrite bad fd (must return -1)");
+
+  msg ("close \"p\"");
+  close (fd);
+}
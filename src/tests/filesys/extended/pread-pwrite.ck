@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(pread-pwrite) begin
+(pread-pwrite) create "p"
+(pread-pwrite) open "p"
+(pread-pwrite) pwrite 512 bytes at 512 (returned 512)
+(pread-pwrite) pwrite 512 bytes at 0 (returned 512)
+(pread-pwrite) pread 300 bytes at 400 (returned 300)
+(pread-pwrite) pread across end of file (returned 124)
+(pread-pwrite) pread past end of file (returned 0)
+(pread-pwrite) read whole file (returned 1024)
+(pread-pwrite) pread fd 0 (must return -1)
+(pread-pwrite) pwrite fd 1 (must return -1)
+(pread-pwrite) pread bad fd (must return -1)
+(pread-pwrite) pwrite bad fd (must return -1)
+(pread-pwrite) close "p"
+(pread-pwrite) end
+EOF
+pass;
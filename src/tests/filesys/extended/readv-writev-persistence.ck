@@ -0,0 +1,7 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($data) = join ('', map (chr (ord ('a') + $_ % 26), 0...399));
+check_archive ({'v' => [$data]});
+pass;
@@ -0,0 +1,71 @@
+/* Checks that writev() and readv() gather and scatter data in
+   order, advance the file position, stop at end of file, and
+   reject bad file descriptors and too many buffers. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char data[400];
+static char buf[400];
+static struct iovec iov[IOV_MAX + 1];
+
+void
+test_main (void) 
+{
+  int fd, retval;
+  size_t i;
+
+  for (i = 0; i < sizeof data; i++)
+    data[i] = 'a' + i % 26;
+
+  CHECK (create ("v", 0), "create \"v\"");
+  CHECK ((fd = open ("v")) > 1, "open \"v\"");
+
+  iov[0].iov_base = data;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = data + 100;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = data + 100;
+  iov[2].iov_len = 300;
+  retval = writev (fd, iov, 3);
+  CHECK (retval == 400, "writev 3 buffers (returned %d)", retval);
+  CHECK (tell (fd) == 400, "tell \"v\" after writev");
+
+  seek (fd, 0);
+  iov[0].iov_base = buf;
+  iov[0].iov_len = 50;
+  iov[1].iov_base = buf + 50;
+  iov[1].iov_len = 250;
+  iov[2].iov_base = buf + 300;
+  iov[2].iov_len = 200;
+  retval = readv (fd, iov, 3);
+  CHECK (retval == 400, "readv 3 buffers (returned %d)", retval);
+  compare_bytes (buf, data, sizeof buf, 0, "v");
+  CHECK (tell (fd) == 400, "tell \"v\" after readv");
+
+  retval = readv (fd, iov, 3);
+  CHECK (retval == 0, "readv at end of file (returned %d)", retval);
+
+  for (i = 0; i < IOV_MAX + 1; i++) 
+    {
+      iov[i].iov_base = buf + i;
+      iov[i].iov_len = 1;
+    }
+  CHECK (readv (fd, iov, IOV_MAX + 1) == -1,
+         "readv %d buffers (must return -1)", IOV_MAX + 1);
+  CHECK (writev (fd, iov, IOV_MAX + 1) == -1,
+         "writev %d buffers (must return -1)", IOV_MAX + 1);
+  CHECK (readv (fd, iov, -1) == -1, "readv -1 buffers (must return -1)");
+  CHECK (readv (fd, iov, 0) == 0, "readv 0 buffers");
+  CHECK (readv (0x20101234, iov, 1) == -1, "readv bad fd (must return -1)");
+  CHECK (writev (0x20101234, iov, 1) == -1,
+         "writev bad fd (must return -1)");
+  CHECK (writev (0, iov, 1) == -1,
+         "writev fd 0 (must return -1)");
+  CHECK (tell (fd) == 400, "tell \"v\" unchanged");
+
+  msg ("close \"v\"");
+  close (fd);
+}
@@ -0,0 +1,25 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(readv-writev) begin
+(readv-writev) create "v"
+(readv-writev) open "v"
+(readv-writev) writev 3 buffers (returned 400)
+(readv-writev) tell "v" after writev
+(readv-writev) readv 3 buffers (returned 400)
+(readv-writev) tell "v" after readv
+(readv-writev) readv at end of file (returned 0)
+(readv-writev) readv 65 buffers (must return -1)
+(readv-writev) writev 65 buffers (must return -1)
+(readv-writev) readv -1 buffers (must return -1)
+(readv-writev) readv 0 buffers
+(readv-writev) readv bad fd (must return -1)
+(readv-writev) writev bad fd (must return -1)
+(readv-writev) writev fd 0 (must return -1)
+(readv-writev) tell "v" unchanged
+(readv-writev) close "v"
+(readv-writev) end
+EOF
+pass;
@@ -29,8 +29,10 @@
 #include "userprog/tss.h"
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/inode.h"
 #include "vm/page.h"
 #include "vm/swap.h"
 
@@ -246,6 +248,10 @@ parse_options (char **argv)
         shutdown_configure (SHUTDOWN_REBOOT);
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-extents"))
+        inode_set_extents (true);
+      else if (!strcmp (name, "-delalloc"))
+        inode_set_delayed_alloc (true);
       else if (!strcmp (name, "-filesys"))
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
@@ -258,6 +264,24 @@ parse_options (char **argv)
         thread_mlfqs = true;
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
+      else if (!strcmp (name, "-cache"))
+        {
+          int sectors = value != NULL ? atoi (value) : 0;
+          if (sectors <= 0)
+            PANIC ("bad cache size `%s' (use -h for help)", value);
+          cache_set_size (sectors);
+        }
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (value == NULL)
+            PANIC ("missing cache policy (use -h for help)");
+          else if (!strcmp (value, "clock"))
+            cache_set_policy (CACHE_CLOCK);
+          else if (!strcmp (value, "2q"))
+            cache_set_policy (CACHE_2Q);
+          else
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
       else
         PANIC ("unknown option `%s' (use -h for help)", name);
     }
@@ -356,12 +380,16 @@ usage (void)
           "  -q                 Power off VM after actions or on panic.\n"
           "  -r                 Reboot after actions.\n"
           "  -f                 Format file system device during startup.\n"
+          "  -extents           With -f, map file data with extents.\n"
+          "  -delalloc          Place written file data on disk at flush.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+          "  -cache=COUNT       Cache COUNT disk sectors (at most 65536).\n"
+          "  -cache-policy=POL  Replace cached sectors with POL (clock, 2q).\n"
           );
   shutdown_power_off ();
 }
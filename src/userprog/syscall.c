@@ -1,5 +1,6 @@
 #include "userprog/syscall.h"
 #include <stdio.h>
+#include <limits.h>
 #include <syscall-nr.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
@@ -18,6 +19,7 @@
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/cache.h"
 #include "devices/input.h"
 #include "threads/pte.h"
 
@@ -26,6 +28,9 @@ static inline bool valid_vaddr_range(const void * vaddr, unsigned size);
 static bool preload_user_memory (const void *vaddr, size_t size,
                                  bool allocate, uint8_t *esp);
 static bool unpin_user_memory (uint32_t *pd, const void *vaddr, size_t size);
+static int preload_iovecs (struct iovec *kiov, const struct iovec *iov,
+                           int cnt, bool to_be_written, uint8_t *esp);
+static void unpin_iovecs (const struct iovec *kiov, int cnt);
 static void syscall_handler (struct intr_frame *);
 static inline bool valid_vaddr_range(const void * vaddr, unsigned size);
 
@@ -43,6 +48,12 @@ static int   _open (const char *file, uint8_t *esp);
 static int   _filesize (int fd);
 static int   _read (int fd, void *buffer, unsigned size, uint8_t *esp);
 static int   _write (int fd, const void *buffer, unsigned size, uint8_t *esp);
+static int   _pread (int fd, void *buffer, unsigned size, unsigned position,
+                     uint8_t *esp);
+static int   _pwrite (int fd, const void *buffer, unsigned size,
+                      unsigned position, uint8_t *esp);
+static int   _readv (int fd, const struct iovec *iov, int cnt, uint8_t *esp);
+static int   _writev (int fd, const struct iovec *iov, int cnt, uint8_t *esp);
 static void  _seek (int fd, unsigned position);
 static unsigned _tell (int fd);
 static void  _close (int fd);
@@ -53,6 +64,9 @@ static bool _mkdir (const char *dir);
 static bool _readdir (int fd, char *name);
 static bool _isdir (int fd);
 static int  _inumber (int fd);
+static bool _cachestat (struct cache_stats *stats, uint8_t *esp);
+static int  _readdirs (int fd, struct readdir_entry *entries, size_t cnt,
+                       uint8_t *esp);
 
 void
 syscall_init (void) 
@@ -76,7 +90,7 @@ syscall_handler (struct intr_frame *f UNUSED)
 
   /* Convert ESP to a int pointer */
   int * esp = (int *)f->esp;
-  uint32_t arg1, arg2, arg3;
+  uint32_t arg1, arg2, arg3, arg4;
 
   if ( !valid_vaddr_range(esp, 0) )
     _exit (-1);
@@ -146,6 +160,40 @@ syscall_handler (struct intr_frame *f UNUSED)
       f->eax = (uint32_t) _write ((int)arg1, (const void*)arg2, arg3, f->esp);
       break;
 
+    case SYS_PREAD:
+      arg1 = get_argument (esp, 1);
+      arg2 = get_argument (esp, 2);
+      arg3 = get_argument (esp, 3);
+      arg4 = get_argument (esp, 4);
+      f->eax = (uint32_t) _pread ((int)arg1, (void*)arg2, arg3, arg4,
+                                  f->esp);
+      break;
+
+    case SYS_PWRITE:
+      arg1 = get_argument (esp, 1);
+      arg2 = get_argument (esp, 2);
+      arg3 = get_argument (esp, 3);
+      arg4 = get_argument (esp, 4);
+      f->eax = (uint32_t) _pwrite ((int)arg1, (const void*)arg2, arg3, arg4,
+                                   f->esp);
+      break;
+
+    case SYS_READV:
+      arg1 = get_argument (esp, 1);
+      arg2 = get_argument (esp, 2);
+      arg3 = get_argument (esp, 3);
+      f->eax = (uint32_t) _readv ((int)arg1, (const struct iovec*)arg2,
+                                  (int)arg3, f->esp);
+      break;
+
+    case SYS_WRITEV:
+      arg1 = get_argument (esp, 1);
+      arg2 = get_argument (esp, 2);
+      arg3 = get_argument (esp, 3);
+      f->eax = (uint32_t) _writev ((int)arg1, (const struct iovec*)arg2,
+                                   (int)arg3, f->esp);
+      break;
+
     case SYS_SEEK:
       arg1 = get_argument (esp, 1);
       arg2 = get_argument (esp, 2);
@@ -199,6 +247,19 @@ syscall_handler (struct intr_frame *f UNUSED)
       f->eax = (uint32_t) _inumber((int)arg1);
       break;
 
+    case SYS_CACHESTAT:
+      arg1 = get_argument(esp, 1);
+      f->eax = (uint32_t) _cachestat((struct cache_stats *)arg1, f->esp);
+      break;
+
+    case SYS_READDIRS:
+      arg1 = get_argument(esp, 1);
+      arg2 = get_argument(esp, 2);
+      arg3 = get_argument(esp, 3);
+      f->eax = (uint32_t) _readdirs ((int)arg1, (struct readdir_entry *)arg2,
+                                     (size_t)arg3, f->esp);
+      break;
+
     default:
       break;
   }
@@ -438,6 +499,148 @@ _write (int fd, const void *buffer, unsigned size, uint8_t *esp)
   return result;
 }
 
+/* Reads SIZE bytes at byte POSITION of file FD into BUFFER, without
+   moving the file position.  Returns the number of bytes read, or -1
+   if FD is not a file open for reading at a position. */
+static int
+_pread (int fd, void *buffer, unsigned size, unsigned position, uint8_t *esp)
+{
+  if (!valid_vaddr_range (buffer, size))
+    _exit (-1);
+
+#ifdef EXPLICIT_MEM_CHECK
+  if (!check_user_memory (buffer, size, true))
+    _exit (-1);
+#endif
+
+  struct thread *t = thread_current ();
+  if (fd < 2 || !valid_file_handler (t, fd) || (off_t) position < 0)
+    return -1;
+  struct file *file = t->file_handlers[fd];
+  if (inode_is_dir (file_get_inode (file)))
+    return -1;
+  if (size == 0)
+    return 0;
+
+  if (!preload_user_memory (buffer, size, true, esp))
+    _exit (-1);
+
+  /* Verify whether the buffer to read data to is writable */
+  void *upage = pg_round_down (buffer);
+  while (upage < buffer + size)
+  {
+    uint32_t *pte = lookup_page (t->pagedir, upage, false);
+    ASSERT (pte != NULL);
+    if (!(*pte & PTE_W))
+      _exit (-1);
+    upage += PGSIZE;
+  }
+
+  int result = file_read_at (file, buffer, size, position);
+  unpin_user_memory (t->pagedir, buffer, size);
+  return result;
+}
+
+/* Writes SIZE bytes from BUFFER at byte POSITION of file FD, without
+   moving the file position.  Returns the number of bytes written, or
+   -1 if FD is not a file open for writing at a position. */
+static int
+_pwrite (int fd, const void *buffer, unsigned size, unsigned position,
+         uint8_t *esp)
+{
+  if (!valid_vaddr_range (buffer, size))
+    _exit (-1);
+
+#ifdef EXPLICIT_MEM_CHECK
+  if (!check_user_memory (buffer, size, false))
+    _exit (-1);
+#endif
+
+  struct thread *t = thread_current ();
+  if (fd < 2 || !valid_file_handler (t, fd) || (off_t) position < 0)
+    return -1;
+  struct file *file = t->file_handlers[fd];
+  if (inode_is_dir (file_get_inode (file)))
+    return -1;
+  if (size == 0)
+    return 0;
+
+  if (!preload_user_memory (buffer, size, false, esp))
+    _exit (-1);
+
+  int result = file_write_at (file, buffer, size, position);
+  unpin_user_memory (t->pagedir, buffer, size);
+  return result;
+}
+
+/* Reads from file FD into the CNT buffers of IOV in order, in a single
+   pass over the file straight into the pinned buffers.  Returns the
+   number of bytes read, or -1 on failure. */
+static int
+_readv (int fd, const struct iovec *iov, int cnt, uint8_t *esp)
+{
+  struct iovec kiov[IOV_MAX];
+  struct thread *t = thread_current ();
+
+  if (fd == STDOUT_FILENO || !valid_file_handler (t, fd))
+    return -1;
+  if (fd != STDIN_FILENO
+      && inode_is_dir (file_get_inode (t->file_handlers[fd])))
+    return -1;
+
+  int size = preload_iovecs (kiov, iov, cnt, true, esp);
+  if (size <= 0)
+    return size;
+
+  int result = 0;
+  if (fd == STDIN_FILENO)
+  {
+    int i;
+    size_t j;
+    for (i = 0; i < cnt; i++)
+      for (j = 0; j < kiov[i].iov_len; j++, result++)
+        ((uint8_t *) kiov[i].iov_base)[j] = input_getc ();
+  }
+  else
+    result = file_readv (t->file_handlers[fd], kiov, cnt);
+  unpin_iovecs (kiov, cnt);
+  return result;
+}
+
+/* Writes the CNT buffers of IOV in order to file FD, in a single pass
+   over the file straight from the pinned buffers.  The file's lock is
+   held throughout, so the whole vector lands in one piece even when
+   another process extends the file at the same time.  Returns the
+   number of bytes written, or -1 on failure. */
+static int
+_writev (int fd, const struct iovec *iov, int cnt, uint8_t *esp)
+{
+  struct iovec kiov[IOV_MAX];
+  struct thread *t = thread_current ();
+
+  if (fd == STDIN_FILENO || !valid_file_handler (t, fd))
+    return -1;
+  if (fd != STDOUT_FILENO
+      && inode_is_dir (file_get_inode (t->file_handlers[fd])))
+    return -1;
+
+  int size = preload_iovecs (kiov, iov, cnt, false, esp);
+  if (size <= 0)
+    return size;
+
+  int result = size;
+  if (fd == STDOUT_FILENO)
+  {
+    int i;
+    for (i = 0; i < cnt; i++)
+      putbuf (kiov[i].iov_base, kiov[i].iov_len);
+  }
+  else
+    result = file_writev (t->file_handlers[fd], kiov, cnt);
+  unpin_iovecs (kiov, cnt);
+  return result;
+}
+
 static void
 _seek (int fd, unsigned position)
 {
@@ -648,6 +851,73 @@ unpin_user_memory (uint32_t *pd, const void *vaddr, size_t size)
   return true;
 }
 
+/* Copies the CNT entries of user iovec array IOV into KIOV, which
+   has room for IOV_MAX, then validates and pins every buffer they
+   describe, checking that each is writable if TO_BE_WRITTEN.  Returns
+   the total length of the buffers, or -1 if CNT or the total is out
+   of range.  Terminates the process if any of the memory is bad. */
+static int
+preload_iovecs (struct iovec *kiov, const struct iovec *iov, int cnt,
+                bool to_be_written, uint8_t *esp)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  size_t total = 0;
+  int i;
+
+  if (cnt < 0 || cnt > IOV_MAX)
+    return -1;
+  if (cnt == 0)
+    return 0;
+
+  if (!preload_user_memory (iov, cnt * sizeof *iov, false, esp))
+    _exit (-1);
+  memcpy (kiov, iov, cnt * sizeof *iov);
+  unpin_user_memory (pd, iov, cnt * sizeof *iov);
+
+  for (i = 0; i < cnt; i++)
+  {
+    if (!valid_vaddr_range (kiov[i].iov_base, kiov[i].iov_len))
+      _exit (-1);
+    if (kiov[i].iov_len > (size_t) INT_MAX - total)
+      return -1;
+    total += kiov[i].iov_len;
+  }
+
+  for (i = 0; i < cnt; i++)
+  {
+    void *base = kiov[i].iov_base;
+    size_t len = kiov[i].iov_len;
+    if (len == 0)
+      continue;
+    if (!preload_user_memory (base, len, to_be_written, esp))
+      _exit (-1);
+
+    /* Verify whether the buffer to read data to is writable */
+    void *upage = pg_round_down (base);
+    while (to_be_written && upage < base + len)
+    {
+      uint32_t *pte = lookup_page (pd, upage, false);
+      ASSERT (pte != NULL);
+      if (!(*pte & PTE_W))
+        _exit (-1);
+      upage += PGSIZE;
+    }
+  }
+  return total;
+}
+
+/* Unpins the CNT buffers of KIOV, as pinned by preload_iovecs(). */
+static void
+unpin_iovecs (const struct iovec *kiov, int cnt)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  int i;
+
+  for (i = 0; i < cnt; i++)
+    if (kiov[i].iov_len > 0)
+      unpin_user_memory (pd, kiov[i].iov_base, kiov[i].iov_len);
+}
+
 /* Part3: syscalls for sub-directories */
 static bool
 _chdir (const char *name)
@@ -701,7 +971,12 @@ _mkdir (const char *name)
   if (!filesys_parse (name, &dir, &dir_name))
     return false;
 
-  if (! (dir != NULL && free_map_allocate (1, &inode_sector)))
+  /* Start the directory in an allocation group with free room,
+     preferably its parent's */
+  if (! (dir != NULL
+         && free_map_allocate_near (
+              free_map_dir_goal (inode_get_inumber (dir_get_inode (dir))),
+              1, &inode_sector)))
   {
     dir_close (dir);
     free (dir_name);
@@ -782,6 +1057,75 @@ _inumber (int fd)
   return inumber;
 }
 
+static bool
+_cachestat (struct cache_stats *stats, uint8_t *esp)
+{
+  if (!valid_vaddr_range (stats, sizeof *stats))
+    _exit (-1);
+  if (!preload_user_memory (stats, sizeof *stats, true, esp))
+    _exit (-1);
+
+  /* Verify whether the buffer to copy the counters to is writable */
+  void *upage = pg_round_down (stats);
+  while (upage < (void *) stats + sizeof *stats)
+  {
+    uint32_t *pte = lookup_page (thread_current()->pagedir, upage, false);
+    ASSERT (pte != NULL);
+    if (!(*pte & PTE_W))
+      _exit (-1);
+    upage += PGSIZE;
+  }
+
+  cache_get_stats (stats);
+  unpin_user_memory (thread_current()->pagedir, stats, sizeof *stats);
+  return true;
+}
+
+/* Fills ENTRIES with up to CNT entries of directory FD, starting at
+   its position, and returns how many it filled, or -1 if FD is not a
+   directory. */
+static int
+_readdirs (int fd, struct readdir_entry *entries, size_t cnt, uint8_t *esp)
+{
+  if (cnt > (size_t) PHYS_BASE / sizeof *entries)
+    _exit (-1);
+  size_t size = cnt * sizeof *entries;
+  if (!valid_vaddr_range (entries, size))
+    _exit (-1);
+
+  struct thread *t  = thread_current();
+  if ( !valid_file_handler (t, fd) || fd < 2)
+    _exit(-1);
+  struct file *file = t->file_handlers[fd];
+  struct inode *inode = file_get_inode(file);
+  if (!inode_is_dir(inode))
+    return -1;
+  if (cnt == 0)
+    return 0;
+
+  if (!preload_user_memory (entries, size, true, esp))
+    _exit (-1);
+
+  /* Verify whether the buffer to copy the entries to is writable */
+  void *upage = pg_round_down (entries);
+  while (upage < (void *) entries + size)
+  {
+    uint32_t *pte = lookup_page (t->pagedir, upage, false);
+    ASSERT (pte != NULL);
+    if (!(*pte & PTE_W))
+      _exit (-1);
+    upage += PGSIZE;
+  }
+
+  struct dir *dir = dir_open(inode);
+  dir_set_pos(dir, file_tell(file));
+  int read = dir_readdirs(dir, entries, cnt);
+  file_seek(file, dir_get_pos(dir));
+  free(dir);
+  unpin_user_memory (t->pagedir, entries, size);
+  return read;
+}
+
 #ifdef EXPLICIT_MEM_CHECK
 /* Check whether specified user memory range [ADDR, ADDR + SIZE) is valid. */
 static bool